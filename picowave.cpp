@@ -1,344 +1,4711 @@
-#include <array>
+// the windows build, picowave_alsa.cpp implements the same header on linux
+#if defined(_WIN32)
+
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <cwchar>
+#include <vector>
+
+#include <Windows.h>
+#include <audioclient.h>
+#include <avrt.h>
+#include <mmdeviceapi.h>
+#include <mmreg.h>
+
+#include "picowave.h"
+#include "picowave_internal.h"
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Tracing
+
+// define PW_TRACE_TRACY to emit tracy zones and plots, or PW_TRACE_ETW to
+// emit TraceLogging start/stop events and counters for WPA. without either
+// the trace points compile away. a zone lasts to the end of its scope and
+// only one may be opened per scope.
+#if defined(PW_TRACE_TRACY)
+#include <tracy/Tracy.hpp>
+
+#define PW_TRACE_ZONE(NAME) ZoneScopedN(NAME)
+#define PW_TRACE_COUNTER(NAME, VALUE) TracyPlot(NAME, int64_t(VALUE))
+#define PW_TRACE_THREAD(NAME) tracy::SetThreadName(NAME)
+
+#elif defined(PW_TRACE_ETW)
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+
+// {5a3b7c1e-2f64-4d8a-9b0e-7c1d4e6f8a21}
+TRACELOGGING_DEFINE_PROVIDER(
+    pwTraceProvider,
+    "PicoWave",
+    (0x5a3b7c1e, 0x2f64, 0x4d8a, 0x9b, 0x0e, 0x7c, 0x1d, 0x4e, 0x6f, 0x8a, 0x21));
+
+namespace PicoWave {
+namespace {
+// registered for the life of the module
+struct TraceProvider {
+    TraceProvider()
+    {
+        TraceLoggingRegister(pwTraceProvider);
+    }
+    ~TraceProvider()
+    {
+        TraceLoggingUnregister(pwTraceProvider);
+    }
+} traceProvider;
+
+// start and stop events pair up into regions in wpa
+struct TraceZone {
+    explicit TraceZone(const char* name)
+        : _name(name)
+    {
+        TraceLoggingWrite(pwTraceProvider, "Zone",
+            TraceLoggingOpcode(WINEVENT_OPCODE_START),
+            TraceLoggingString(_name, "Name"));
+    }
+    ~TraceZone()
+    {
+        TraceLoggingWrite(pwTraceProvider, "Zone",
+            TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+            TraceLoggingString(_name, "Name"));
+    }
+    const char* _name;
+};
+}
+}
+
+#define PW_TRACE_ZONE(NAME) TraceZone pwTraceZone(NAME)
+#define PW_TRACE_COUNTER(NAME, VALUE)                     \
+    TraceLoggingWrite(pwTraceProvider, "Counter",         \
+        TraceLoggingString(NAME, "Name"),                 \
+        TraceLoggingInt64(int64_t(VALUE), "Value"))
+#define PW_TRACE_THREAD(NAME)
+
+#else
+#define PW_TRACE_ZONE(NAME)
+#define PW_TRACE_COUNTER(NAME, VALUE)
+#define PW_TRACE_THREAD(NAME)
+#endif
+
+#define MMOK(EXP) ((EXP) == MMSYSERR_NOERROR)
+
+namespace PicoWave {
+
+namespace {
+LONGLONG qpcNow()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+// an export of a loaded module, or NULL. GetProcAddress returns a generic
+// FARPROC and going through void* keeps gcc's -Wcast-function-type quiet
+// about the cast to the real signature
+template <typename proc_t>
+proc_t procAddress(const char* module, const char* name)
+{
+    return (proc_t)(void*)GetProcAddress(GetModuleHandleA(module), name);
+}
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Resampling
+
+// sum of count products, the filter taps and history windows
+typedef float (*DotProc)(const float* a, const float* b, size_t count);
+
+namespace {
+float dotScalar(const float* a, const float* b, size_t count)
+{
+    float sum = 0.f;
+    for (size_t i = 0; i < count; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#if defined(PW_X86)
+float dotSse2(const float* a, const float* b, size_t count)
+{
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i + 0), _mm_loadu_ps(b + i + 0)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    // horizontal add of the four lanes
+    __m128 acc = _mm_add_ps(acc0, acc1);
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    return _mm_cvtss_f32(acc) + dotScalar(a + i, b + i, count - i);
+}
+
+PW_TARGET_AVX2 float dotAvx2(const float* a, const float* b, size_t count)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        acc0 = _mm256_add_ps(
+            acc0, _mm256_mul_ps(_mm256_loadu_ps(a + i + 0), _mm256_loadu_ps(b + i + 0)));
+        acc1 = _mm256_add_ps(
+            acc1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    const __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum) + dotSse2(a + i, b + i, count - i);
+}
+#endif // PW_X86
+
+DotProc selectDot()
+{
+#if defined(PW_X86)
+    return cpuHasAvx2() ? dotAvx2 : dotSse2;
+#else
+    return dotScalar;
+#endif
+}
+
+uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b) {
+        const uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// zeroth order modified bessel function for the kaiser window
+double besselI0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 32; ++k) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+// upper limit on the filter phases, the reduced output rate of the ratio
+const uint32_t maxPhases = 1024;
+
+// taps per phase, kaiser beta and passband edge for each quality setting
+const struct {
+    uint32_t taps;
+    double beta;
+    double rolloff;
+} resampleQuality[] = {
+    { 16, 6.0, 0.90 },
+    { 32, 8.5, 0.94 },
+    { 64, 10.0, 0.97 },
+};
+}
+
+// streaming rational polyphase resampler over interleaved float32
+//
+// the output rate is inRate * L / M with the ratio reduced so L is the
+// number of filter phases. each channel keeps its own history so a phase
+// is a single contiguous dot product, and all storage is sized by init()
+// so push and pull never allocate.
+struct Resampler {
+
+    Resampler()
+        : _channels(0)
+        , _taps(0)
+        , _up(0)
+        , _down(0)
+        , _phase(0)
+        , _index(0)
+        , _fill(0)
+        , _stride(0)
+        , _block(0)
+        , _dot(NULL)
+        , _deinterleave(NULL)
+    {
+    }
+
+    // maxOutput is the most frames a single pull() will ask for
+    bool init(uint32_t inRate, uint32_t outRate, uint32_t channels, uint32_t quality,
+        uint32_t maxOutput)
+    {
+        release();
+        const uint32_t div = gcd(inRate, outRate);
+        _up = outRate / div;
+        _down = inRate / div;
+        if (_up > maxPhases || quality > PW_RESAMPLE_BEST) {
+            return false;
+        }
+        _channels = channels;
+        _taps = resampleQuality[quality].taps;
+        _dot = selectDot();
+        _deinterleave = selectDeinterleave(channels);
+        _design(resampleQuality[quality].beta, resampleQuality[quality].rolloff);
+        // history for a full filter window plus the input for one pull and
+        // the block that may be left over from the one before it
+        _block = blockFrames(maxOutput);
+        _stride = _taps + 2 * _block + 2;
+        _history.assign(size_t(_stride) * _channels, 0.f);
+        // start with a window of silence so the first output is defined
+        _fill = _taps - 1;
+        _index = _taps - 1;
+        _phase = 0;
+        return true;
+    }
+
+    void release()
+    {
+        _coefs.clear();
+        _history.clear();
+        _up = 0;
+    }
+
+    bool valid() const
+    {
+        return _up != 0;
+    }
+
+    // input frames to render per push so the callback sees a fixed size
+    uint32_t blockFrames(uint32_t numOutput) const
+    {
+        return uint32_t((uint64_t(numOutput) * _down + _up - 1) / _up) + 1;
+    }
+
+    uint32_t block() const
+    {
+        return _block;
+    }
+
+    // true once enough input is buffered to pull numOutput frames
+    bool ready(size_t numOutput) const
+    {
+        const uint64_t last = _index + (uint64_t(_phase) + uint64_t(numOutput - 1) * _down) / _up;
+        return last < _fill;
+    }
+
+    // append interleaved input frames
+    void push(const float* in, size_t numFrames)
+    {
+        assert(_fill + numFrames <= _stride);
+        _deinterleave(in, numFrames, _channels, &_history[_fill], _stride);
+        _fill += uint32_t(numFrames);
+    }
+
+    // produce interleaved output frames, ready() must hold
+    void pull(float* out, size_t numFrames)
+    {
+        assert(ready(numFrames));
+        for (size_t i = 0; i < numFrames; ++i) {
+            const float* coefs = &_coefs[size_t(_phase) * _taps];
+            const size_t start = _index - (_taps - 1);
+            for (uint32_t c = 0; c < _channels; ++c) {
+                const float* window = &_history[size_t(c) * _stride + start];
+                out[i * _channels + c] = _dot(coefs, window, _taps);
+            }
+            _phase += _down;
+            _index += _phase / _up;
+            _phase %= _up;
+        }
+        // drop history the next window no longer reaches
+        const uint32_t shift = _index - (_taps - 1);
+        if (shift) {
+            for (uint32_t c = 0; c < _channels; ++c) {
+                float* base = &_history[size_t(c) * _stride];
+                memmove(base, base + shift, (_fill - shift) * sizeof(float));
+            }
+            _fill -= shift;
+            _index -= shift;
+        }
+    }
+
+protected:
+    // windowed sinc prototype at the upsampled rate, split into phases
+    void _design(double beta, double rolloff)
+    {
+        const double pi = 3.14159265358979323846;
+        const uint32_t length = _taps * _up;
+        const double centre = 0.5 * double(length - 1);
+        // cut off below the lower of the two nyquist rates
+        const double cutoff = rolloff * 0.5 / double(_up > _down ? _up : _down);
+        std::vector<double> proto(length);
+        for (uint32_t n = 0; n < length; ++n) {
+            const double t = double(n) - centre;
+            const double x = 2.0 * cutoff * t;
+            const double sinc = (t == 0.0) ? 1.0 : sin(pi * x) / (pi * x);
+            const double r = t / centre;
+            const double window = besselI0(beta * sqrt(1.0 - r * r)) / besselI0(beta);
+            proto[n] = sinc * window;
+        }
+        // phase p uses every L'th tap from p, stored reversed so it lines up
+        // with the history window oldest sample first
+        _coefs.resize(size_t(_up) * _taps);
+        for (uint32_t p = 0; p < _up; ++p) {
+            double sum = 0.0;
+            for (uint32_t k = 0; k < _taps; ++k) {
+                sum += proto[p + k * _up];
+            }
+            // unity gain per phase keeps dc steady across phases
+            for (uint32_t k = 0; k < _taps; ++k) {
+                const double gain = (sum != 0.0) ? 1.0 / sum : 0.0;
+                _coefs[size_t(p) * _taps + (_taps - 1 - k)] = float(proto[p + k * _up] * gain);
+            }
+        }
+    }
+
+    uint32_t _channels;
+    uint32_t _taps;
+    // reduced output and input rates, the phase count and phase step
+    uint32_t _up;
+    uint32_t _down;
+    uint32_t _phase;
+    // newest history sample under the current window
+    uint32_t _index;
+    // valid samples in each channel's history
+    uint32_t _fill;
+    uint32_t _stride;
+    uint32_t _block;
+    DotProc _dot;
+    DeinterleaveProc _deinterleave;
+    std::vector<float> _coefs;
+    std::vector<float> _history;
+};
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WAV Source
+
+// PrefetchVirtualMemory is windows 8 and later so it is looked up at runtime
+typedef BOOL(WINAPI* PrefetchProc)(
+    HANDLE process, ULONG_PTR count, WIN32_MEMORY_RANGE_ENTRY* ranges, ULONG flags);
+
+namespace {
+uint16_t getU16(const uint8_t* in)
+{
+    return uint16_t(in[0] | (in[1] << 8));
+}
+
+uint32_t getU32(const uint8_t* in)
+{
+    return uint32_t(in[0]) | (uint32_t(in[1]) << 8) | (uint32_t(in[2]) << 16) |
+           (uint32_t(in[3]) << 24);
+}
+}
+
+// a pcm or float wav file streamed straight out of a read only mapping
+//
+// the data chunk is copied out as it is stored so the file must already be in
+// the format being rendered. a window of pages ahead of the read cursor is
+// prefetched so the wave thread does not stall on the disk.
+struct WavSource {
+
+    WavSource()
+        : sampleRate(0)
+        , bitDepth(0)
+        , channels(0)
+        , sampleFormat(PW_SAMPLE_INT)
+        , _file(INVALID_HANDLE_VALUE)
+        , _mapping(NULL)
+        , _view(NULL)
+        , _data(NULL)
+        , _size(0)
+        , _cursor(0)
+        , _prefetched(0)
+        , _window(0)
+        , _prefetch(NULL)
+    {
+    }
+
+    ~WavSource()
+    {
+        close();
+    }
+
+    bool open(const char* path)
+    {
+        close();
+        _file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        LARGE_INTEGER fileSize;
+        if (_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(_file, &fileSize)) {
+            close();
+            return false;
+        }
+        // the whole file is mapped, on 32 bit builds that limits its size
+        if (fileSize.QuadPart < 12 || uint64_t(fileSize.QuadPart) > uint64_t(SIZE_T(-1))) {
+            close();
+            return false;
+        }
+        _mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (_mapping) {
+            _view = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+        if (_view == NULL || !_parse(size_t(fileSize.QuadPart))) {
+            close();
+            return false;
+        }
+        _prefetch = procAddress<PrefetchProc>("kernel32.dll", "PrefetchVirtualMemory");
+        // two seconds ahead covers a slow disk without pinning much memory
+        _window = size_t(sampleRate) * blockAlign() * 2;
+        _cursor = 0;
+        _prefetched = 0;
+        _prefetchAhead();
+        return true;
+    }
+
+    void close()
+    {
+        if (_view) {
+            UnmapViewOfFile(_view);
+            _view = NULL;
+        }
+        if (_mapping) {
+            CloseHandle(_mapping);
+            _mapping = NULL;
+        }
+        if (_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(_file);
+            _file = INVALID_HANDLE_VALUE;
+        }
+        _data = NULL;
+        _size = 0;
+    }
+
+    bool valid() const
+    {
+        return _view != NULL;
+    }
+
+    uint32_t blockAlign() const
+    {
+        return (channels * bitDepth) / 8;
+    }
+
+    // copy up to size bytes of the data chunk, returns the bytes copied
+    size_t read(void* data, size_t size, bool loop)
+    {
+        uint8_t* out = (uint8_t*)data;
+        size_t done = 0;
+        while (done < size) {
+            if (_cursor == _size) {
+                if (!loop) {
+                    break;
+                }
+                _cursor = 0;
+                _prefetched = 0;
+            }
+            _prefetchAhead();
+            const size_t left = _size - _cursor;
+            const size_t count = (size - done) < left ? (size - done) : left;
+            memcpy(out + done, _data + _cursor, count);
+            _cursor += count;
+            done += count;
+        }
+        return done;
+    }
+
+    // format of the data chunk
+    uint32_t sampleRate;
+    uint32_t bitDepth;
+    uint32_t channels;
+    uint32_t sampleFormat;
+
+protected:
+    // find the fmt and data chunks, anything else is skipped
+    bool _parse(size_t size)
+    {
+        if (memcmp(_view, "RIFF", 4) || memcmp(_view + 8, "WAVE", 4)) {
+            return false;
+        }
+        bool haveFormat = false;
+        size_t pos = 12;
+        while (pos + 8 <= size) {
+            const uint8_t* chunk = _view + pos;
+            const size_t body = pos + 8;
+            const size_t length = getU32(chunk + 4);
+            if (memcmp(chunk, "fmt ", 4) == 0) {
+                if (length < 16 || length > size - body) {
+                    return false;
+                }
+                uint16_t tag = getU16(chunk + 8);
+                channels = getU16(chunk + 10);
+                sampleRate = getU32(chunk + 12);
+                bitDepth = getU16(chunk + 22);
+                // extensible keeps the real tag at the start of its sub format
+                if (tag == 0xfffe && length >= 40) {
+                    tag = getU16(chunk + 8 + 24);
+                }
+                if (tag == WAVE_FORMAT_PCM) {
+                    sampleFormat = PW_SAMPLE_INT;
+                } else if (tag == WAVE_FORMAT_IEEE_FLOAT && bitDepth == 32) {
+                    sampleFormat = PW_SAMPLE_FLOAT;
+                } else {
+                    return false;
+                }
+                if (channels < 1 || channels > 8 || bitDepth % 8 || bitDepth == 0 ||
+                    bitDepth > 32) {
+                    return false;
+                }
+                haveFormat = true;
+            } else if (memcmp(chunk, "data", 4) == 0) {
+                if (!haveFormat) {
+                    return false;
+                }
+                // a file cut short or never finalized runs to its end
+                _size = length < size - body ? length : size - body;
+                _size -= _size % blockAlign();
+                _data = _view + body;
+                return _size != 0;
+            }
+            if (length > size - body) {
+                return false;
+            }
+            // chunks are padded to an even length
+            pos = body + length + (length & 1);
+        }
+        return false;
+    }
+
+    // keep a window of pages requested ahead of the cursor, topped up once
+    // half of it has been consumed
+    void _prefetchAhead()
+    {
+        if (_prefetched == _size || _prefetched >= _cursor + _window / 2) {
+            return;
+        }
+        const size_t start = _prefetched > _cursor ? _prefetched : _cursor;
+        const size_t end = (_size - _cursor > _window) ? _cursor + _window : _size;
+        if (_prefetch && end > start) {
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = (PVOID)(_data + start);
+            range.NumberOfBytes = end - start;
+            // this only queues the reads, it does not wait for them
+            _prefetch(GetCurrentProcess(), 1, &range, 0);
+        }
+        _prefetched = end;
+    }
+
+    HANDLE _file;
+    HANDLE _mapping;
+    const uint8_t* _view;
+    const uint8_t* _data;
+    // bytes in the data chunk and the next one to read
+    size_t _size;
+    size_t _cursor;
+    // end of the range handed to prefetch so far
+    size_t _prefetched;
+    size_t _window;
+    PrefetchProc _prefetch;
+};
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Service Threads
+
+// per thread setup for anything servicing devices
+struct ThreadScope {
+
+    ThreadScope(bool com, uint32_t priority)
+        : _comInit(false)
+        , _mmcss(NULL)
+    {
+        // wasapi interfaces are used from this thread so it must join the mta
+        if (com) {
+            _comInit = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+        }
+        // mmcss registration has to be made by the thread itself
+        if (priority == PW_PRIORITY_MMCSS) {
+            DWORD taskIndex = 0;
+            _mmcss = AvSetMmThreadCharacteristicsA("Pro Audio", &taskIndex);
+            if (_mmcss == NULL) {
+                // the mmcss service may be disabled so fall back to a raw boost
+                SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+            }
+        }
+    }
+
+    ~ThreadScope()
+    {
+        if (_mmcss) {
+            AvRevertMmThreadCharacteristics(_mmcss);
+        }
+        if (_comInit) {
+            CoUninitialize();
+        }
+    }
+
+    bool _comInit;
+    HANDLE _mmcss;
+};
+
+namespace {
+// apply the settings that must be made before a suspended thread first runs
+uint32_t configureThread(HANDLE thread, uint32_t priority, uint64_t affinity)
+{
+    if (priority == PW_PRIORITY_TIME_CRITICAL) {
+        if (SetThreadPriority(thread, THREAD_PRIORITY_TIME_CRITICAL) == FALSE) {
+            return PW_THREADPRIORITY_ERROR;
+        }
+    }
+    if (affinity) {
+        if (SetThreadAffinityMask(thread, DWORD_PTR(affinity)) == 0) {
+            return PW_THREADAFFINITY_ERROR;
+        }
+    }
+    return PW_OK;
+}
+}
+
+struct GroupDetail {
+
+    GroupDetail()
+        : _generation(0)
+        , _applied(0)
+        , _control(NULL)
+        , _applyEvent(NULL)
+        , _thread(NULL)
+        , _alive(0)
+        , _priority(PW_PRIORITY_DEFAULT)
+        , _error(PW_OK)
+    {
+        InitializeCriticalSection(&_lock);
+        _members.reserve(maxMembers);
+    }
+
+    ~GroupDetail();
+
+    bool open(uint32_t priority, uint64_t affinity);
+
+    bool close();
+
+    bool add(Detail* member);
+
+    void remove(Detail* member);
+
+    bool isOpen() const
+    {
+        return _thread != NULL;
+    }
+
+    uint32_t lastError() const
+    {
+        return _error;
+    }
+
+    // one wait slot is kept for the control event
+    static const size_t maxMembers = MAXIMUM_WAIT_OBJECTS - 1;
+
+protected:
+    static DWORD WINAPI _threadProc(LPVOID param);
+    void _waitForApply(uint32_t generation);
+
+    CRITICAL_SECTION _lock;
+    // guarded by _lock, the thread works from its own copy
+    std::vector<Detail*> _members;
+    // bumped by every membership change and echoed back by the thread once
+    // it has picked the change up, after which it won't touch removed members
+    LONG volatile _generation;
+    LONG volatile _applied;
+    HANDLE _control;
+    HANDLE _applyEvent;
+    HANDLE _thread;
+    LONG volatile _alive;
+    uint32_t _priority;
+    uint32_t _error;
+};
+
+// capture stream, declared here so a duplex output can service it from its
+// own thread right before it renders
+struct InDetail {
+
+    InDetail()
+        : _head(0)
+        , _hwi(NULL)
+        , _device(NULL)
+        , _audioClient(NULL)
+        , _captureClient(NULL)
+        , _comInit(false)
+        , _stopEvent(NULL)
+        , _waveEvent(NULL)
+        , _waveThread(NULL)
+        , _duplex(NULL)
+        , _running(0)
+        , _rawAlloc(NULL)
+        , _period(NULL)
+        , _periodFill(0)
+        , _qpcFreq(1)
+        , _error(PW_OK)
+    {
+        LARGE_INTEGER freq;
+        if (QueryPerformanceFrequency(&freq)) {
+            _qpcFreq = freq.QuadPart;
+        }
+        _stats.reset();
+        memset(&_info, 0, sizeof(_info));
+    }
+
+    ~InDetail()
+    {
+        close();
+    }
+
+    bool open(const WaveInfo& info);
+
+    bool start();
+
+    bool pause();
+
+    bool close();
+
+    size_t read(void* data, size_t size);
+
+    size_t available() const;
+
+    WaveStats stats() const;
+
+    uint32_t lastError() const
+    {
+        return _error;
+    }
+
+    // called by a duplex output that is closing ahead of the capture
+    void detach()
+    {
+        _duplex = NULL;
+    }
+
+    // hand every period the device has filled to the user, called by the
+    // capture thread or by the duplex output
+    bool service();
+
+protected:
+    bool _validate(const WaveInfo& info);
+    void _deliver(const uint8_t* data, size_t size);
+    void _emit(const void* buffer, size_t bufferSize);
+
+    bool _openWaveIn();
+    bool _serviceWaveIn();
+    void _closeWaveIn();
+
+    bool _openWasapi();
+    bool _serviceWasapi();
+    void _closeWasapi();
+
+    uint32_t _blockAlign() const
+    {
+        return (_info.channels * _info.bitDepth) / 8;
+    }
+
+    bool _isWasapi() const
+    {
+        return _info.backend == PW_BACKEND_WASAPI_SHARED ||
+               _info.backend == PW_BACKEND_WASAPI_EXCLUSIVE;
+    }
+
+    static DWORD WINAPI _threadProc(LPVOID param);
+
+    // one header per period, returned filled in the order they were added
+    std::vector<WAVEHDR> _wavehdr;
+    size_t _head;
+    HWAVEIN _hwi;
+    // wasapi interfaces
+    IMMDevice* _device;
+    IAudioClient* _audioClient;
+    IAudioCaptureClient* _captureClient;
+    bool _comInit;
+    HANDLE _stopEvent;
+    HANDLE _waveEvent;
+    HANDLE _waveThread;
+    // output servicing us in place of _waveThread
+    struct Detail* _duplex;
+    LONG volatile _running;
+    uint8_t* _rawAlloc;
+    // wasapi packets are gathered here into whole periods
+    uint8_t* _period;
+    size_t _periodFill;
+    // captured audio waiting for read() when opened with a push ring
+    PushRing _pushRing;
+    Counters _stats;
+    LONGLONG _qpcFreq;
+    WaveInfo _info;
+    uint32_t _error;
+};
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Device Notifications
+
+// holds a critical section for the life of a scope
+struct ScopedLock {
+
+    explicit ScopedLock(CRITICAL_SECTION& lock)
+        : _lock(lock)
+    {
+        EnterCriticalSection(&_lock);
+    }
+
+    ~ScopedLock()
+    {
+        LeaveCriticalSection(&_lock);
+    }
+
+protected:
+    ScopedLock(const ScopedLock&);
+    ScopedLock& operator=(const ScopedLock&);
+
+    CRITICAL_SECTION& _lock;
+};
+
+// endpoint notifications arrive on a system thread, they only flag the
+// change and wake the service thread which then moves the stream over
+struct DeviceWatch final : IMMNotificationClient {
+
+    DeviceWatch(HANDLE wake, bool followDefault)
+        : _refs(1)
+        , _changed(0)
+        , _wake(wake)
+        , _followDefault(followDefault)
+    {
+        InitializeCriticalSection(&_lock);
+        _id[0] = L'\0';
+    }
+
+    // endpoint id of the device being played on
+    void setId(const wchar_t* id)
+    {
+        EnterCriticalSection(&_lock);
+        wcsncpy(_id, id, maxId - 1);
+        _id[maxId - 1] = L'\0';
+        LeaveCriticalSection(&_lock);
+    }
+
+    // true once per change since the last call
+    bool takeChanged()
+    {
+        return InterlockedExchange(&_changed, 0) != 0;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID iid, void** out) override
+    {
+        if (IsEqualIID(iid, __uuidof(IUnknown)) ||
+            IsEqualIID(iid, __uuidof(IMMNotificationClient))) {
+            AddRef();
+            *out = this;
+            return S_OK;
+        }
+        *out = NULL;
+        return E_NOINTERFACE;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override
+    {
+        return ULONG(InterlockedIncrement(&_refs));
+    }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        const LONG refs = InterlockedDecrement(&_refs);
+        if (refs == 0) {
+            delete this;
+        }
+        return ULONG(refs);
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDeviceStateChanged(LPCWSTR id, DWORD state) override
+    {
+        if (state != DEVICE_STATE_ACTIVE) {
+            _flagIfCurrent(id);
+        }
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDeviceAdded(LPCWSTR) override
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDeviceRemoved(LPCWSTR id) override
+    {
+        _flagIfCurrent(id);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnDefaultDeviceChanged(EDataFlow flow, ERole role, LPCWSTR) override
+    {
+        if (_followDefault && flow == eRender && role == eConsole) {
+            _flag();
+        }
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnPropertyValueChanged(LPCWSTR, const PROPERTYKEY) override
+    {
+        return S_OK;
+    }
+
+protected:
+    ~DeviceWatch()
+    {
+        DeleteCriticalSection(&_lock);
+    }
+
+    void _flag()
+    {
+        InterlockedExchange(&_changed, 1);
+        SetEvent(_wake);
+    }
+
+    void _flagIfCurrent(LPCWSTR id)
+    {
+        EnterCriticalSection(&_lock);
+        const bool current = id && wcscmp(id, _id) == 0;
+        LeaveCriticalSection(&_lock);
+        if (current) {
+            _flag();
+        }
+    }
+
+    static const size_t maxId = 256;
+
+    LONG volatile _refs;
+    LONG volatile _changed;
+    HANDLE _wake;
+    bool _followDefault;
+    CRITICAL_SECTION _lock;
+    wchar_t _id[maxId];
+};
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveOut Implementation
+
+struct Detail {
+
+    Detail()
+        : _head(0)
+        , _inFlight(0)
+        , _depth(0)
+        , _stableWakes(0)
+        , _shrinkWakes(0)
+        , _depthFloor(0)
+        , _hwo(NULL)
+        , _device(NULL)
+        , _audioClient(NULL)
+        , _renderClient(NULL)
+        , _audioClock(NULL)
+        , _audioClockFreq(0)
+        , _bufferFrames(0)
+        , _periodFrames(0)
+        , _engineFrames(0)
+        , _comInit(false)
+        , _enumerator(NULL)
+        , _watch(NULL)
+        , _recovering(false)
+        , _lost(false)
+        , _submittedBase(0)
+        , _playedBase(0)
+        , _lastPlayed(0)
+        , _primed(false)
+        , _acquired(false)
+        , _wavFile(INVALID_HANDLE_VALUE)
+        , _wavBytes(0)
+        , _clockStart(0)
+        , _clockPeriods(0)
+        , _stopEvent(NULL)
+        , _waveEvent(NULL)
+        , _waveThread(NULL)
+        , _group(NULL)
+        , _capture(NULL)
+        , _running(0)
+        , _fadeTarget(0)
+        , _fadeGain(0.f)
+        , _failed(0)
+        , _rawAlloc(NULL)
+        , _floatAlloc(NULL)
+        , _floatBuffer(NULL)
+        , _floatFrames(0)
+        , _contentAlloc(NULL)
+        , _contentBuffer(NULL)
+        , _convert(NULL)
+        , _ramp(NULL)
+        , _reportStop(NULL)
+        , _reportEvent(NULL)
+        , _reportThread(NULL)
+        , _qpcFreq(1)
+        , _framesSubmitted(0)
+        , _error(PW_OK)
+    {
+        LARGE_INTEGER freq;
+        if (QueryPerformanceFrequency(&freq)) {
+            _qpcFreq = freq.QuadPart;
+        }
+        _stats.reset();
+        _dither.seed();
+        memset(&_info, 0, sizeof(_info));
+        InitializeCriticalSection(&_deviceLock);
+        InitializeCriticalSection(&_captureLock);
+    }
+
+    ~Detail()
+    {
+        close();
+        DeleteCriticalSection(&_captureLock);
+        DeleteCriticalSection(&_deviceLock);
+    }
+
+    bool open(const WaveInfo& info);
+
+    bool start();
+
+    bool pause();
+
+    bool close();
+
+    size_t write(const void* data, size_t size);
+
+    size_t available() const;
+
+    WaveStats stats() const;
+
+    bool position(WavePosition& out) const;
+
+    void* acquire(size_t& size, uint32_t timeoutMs);
+
+    bool commit();
+
+    bool setGain(float gain, uint32_t rampFrames);
+
+    bool setCallback(WaveProc callback, void* callbackData);
+
+    uint32_t lastError() const
+    {
+        return _error;
+    }
+
+    // true if a thread of ours wakes each period, so a capture can ride on it
+    bool isServiced() const
+    {
+        return _waveThread != NULL || _group != NULL;
+    }
+
+    // true if that thread has joined the mta, which wasapi capture needs
+    bool isComThread() const
+    {
+        return _group != NULL || (_waveThread != NULL && _isWasapi());
+    }
+
+    // set or clear the duplex capture, once this returns the old one will
+    // not be serviced again
+    bool attachCapture(InDetail* capture);
+
+    // the two halves of start() for startOutputs(), everything slow happens
+    // in arm() so release() is only the device start
+    bool arm();
+
+    bool release(LONGLONG due);
+
+protected:
+    bool _arm();
+    bool _release();
+    bool _allocate();
+    bool _prepare(bool write);
+    bool _preroll();
+    void _countSubmit(uint32_t frames);
+    bool _validate(const WaveInfo& info);
+    void _render(void* buffer, size_t bufferSize);
+    void _checkDeadline(LONGLONG begin, LONGLONG ticks, size_t bufferSize);
+    bool _openReports();
+    bool _openSource();
+    bool _closeReports();
+    void _fill(void* buffer, size_t bufferSize);
+    void _resample(float* buffer, size_t numFrames);
+    void _fade(float* buffer, size_t numFrames);
+    bool _post(const Command& cmd);
+    void _source(void* buffer, size_t bufferSize);
+    bool _service();
+    bool _wake();
+    void _kick();
+
+    bool _isOpen() const
+    {
+        return _waveThread || _group || (_isDirect() && (_hwo || _audioClient));
+    }
+
+    // no callback or push ring, the caller renders through acquire()
+    bool _isDirect() const
+    {
+        return _info.callback == nullptr && _info.pushSize == 0 && _info.sourcePath == nullptr;
+    }
+
+    bool _headerFree(const WAVEHDR& hdr) const
+    {
+        return (hdr.dwFlags & WHDR_DONE) || !(hdr.dwFlags & WHDR_INQUEUE);
+    }
+
+    bool _openWaveOut();
+    bool _serviceWaveOut();
+    bool _writeHeader(WAVEHDR& hdr);
+    void _adapt(bool late);
+    bool _closeWaveOut();
+
+    bool _openWasapi();
+    bool _createWasapi(bool prime);
+    bool _watchDevice();
+    bool _serviceWasapi();
+    void _releaseWasapi();
+    bool _closeWasapi();
+
+    bool _recover();
+    bool _checkLost();
+    bool _reopen();
+    bool _readPosition(WavePosition& out) const;
+
+    bool _openNull();
+    bool _serviceNull();
+    bool _closeNull();
+
+    uint32_t _blockAlign() const
+    {
+        return (_info.channels * _info.bitDepth) / 8;
+    }
+
+    // frame size as seen by the callback and push ring
+    uint32_t _sourceBlockAlign() const
+    {
+        if (_info.callbackFormat == PW_CALLBACK_FLOAT32) {
+            return _info.channels * sizeof(float);
+        }
+        return _blockAlign();
+    }
+
+    bool _isWasapi() const
+    {
+        return _info.backend == PW_BACKEND_WASAPI_SHARED ||
+               _info.backend == PW_BACKEND_WASAPI_EXCLUSIVE;
+    }
+
+    bool _isNull() const
+    {
+        return _info.backend == PW_BACKEND_NULL ||
+               _info.backend == PW_BACKEND_NULL_CLOCKED;
+    }
+
+    static DWORD WINAPI _threadProc(LPVOID param);
+    static DWORD WINAPI _reportProc(LPVOID param);
+
+    friend struct GroupDetail;
+
+    // internal wave info, one header per period
+    std::vector<WAVEHDR> _wavehdr;
+    // next header expected back from the device
+    size_t _head;
+    // headers written and not yet returned, they follow _head in the ring
+    uint32_t _inFlight;
+    // periods kept queued at the device, fixed at numBuffers unless adaptive
+    LONG volatile _depth;
+    // wakes since the last underrun and how many it takes to shrink
+    uint32_t _stableWakes;
+    uint32_t _shrinkWakes;
+    // shallowest adaptive depth, raised to cover the shared engine period
+    uint32_t _depthFloor;
+    HWAVEOUT _hwo;
+    // wasapi interfaces
+    IMMDevice* _device;
+    IAudioClient* _audioClient;
+    IAudioRenderClient* _renderClient;
+    IAudioClock* _audioClock;
+    UINT64 _audioClockFreq;
+    // wasapi endpoint buffer and render period in frames
+    UINT32 _bufferFrames;
+    UINT32 _periodFrames;
+    // shared mode engine period, the engine takes a whole one per pass
+    UINT32 _engineFrames;
+    // true if open() initialized com and must release it
+    bool _comInit;
+    // endpoint notifications so the stream can follow device changes
+    IMMDeviceEnumerator* _enumerator;
+    DeviceWatch* _watch;
+    // guards the device handles and _recovering
+    mutable CRITICAL_SECTION _deviceLock;
+    // set while the service thread replaces a lost device. the handles are
+    // then its alone, start() and pause() only record the state they want
+    bool _recovering;
+    // set when a lost device could not be replaced, the handles are released
+    // and everything but close() fails with PW_DEVICE_LOST
+    bool _lost;
+    // frames submitted to devices lost before the current one, and how many
+    // of those they were last seen to have played
+    uint64_t _submittedBase;
+    uint64_t _playedBase;
+    // the last position() result, for when a lost device can not be asked
+    mutable uint64_t _lastPlayed;
+    // true once the device has been handed its first buffers
+    bool _primed;
+    // true between acquire() and commit() in direct mode
+    bool _acquired;
+    // null backend output file and simulated device clock
+    HANDLE _wavFile;
+    uint64_t _wavBytes;
+    LONGLONG volatile _clockStart;
+    LONGLONG _clockPeriods;
+    // signalled by close() to wake the wave thread so it exits
+    HANDLE _stopEvent;
+    HANDLE _waveEvent;
+    HANDLE _waveThread;
+    // shared service thread in place of _waveThread, set while a member
+    GroupDetail* _group;
+    // duplex capture serviced at the top of every wake, guarded by
+    // _captureLock as it is attached from the caller's thread
+    InDetail* _capture;
+    CRITICAL_SECTION _captureLock;
+    // cleared while paused, the service thread parks on its event instead
+    // of servicing the device
+    LONG volatile _running;
+    // fade direction requested by start() and pause(), and the gain the
+    // service thread has ramped to so far
+    LONG volatile _fadeTarget;
+    float _fadeGain;
+    // set by the group thread if servicing failed and it dropped the device
+    LONG volatile _failed;
+    // allocation used for all buffers
+    uint8_t* _rawAlloc;
+    // audio queued by write() when in push mode
+    PushRing _pushRing;
+    // file streamed in place of the callback
+    WavSource _wavSource;
+    // float32 staging buffer and conversion to the device format
+    uint8_t* _floatAlloc;
+    float* _floatBuffer;
+    size_t _floatFrames;
+    // content rate conversion ahead of the staging buffer
+    Resampler _resampler;
+    uint8_t* _contentAlloc;
+    float* _contentBuffer;
+    ConvertProc _convert;
+    RampProc _ramp;
+    DitherState _dither;
+    // changes posted from other threads, drained by the service thread
+    // which keeps its own copy of the callback
+    Controls _controls;
+    // late periods are handed to the reporting thread through _reportRing
+    // so the deadline hook never runs on the wave thread
+    PushRing _reportRing;
+    HANDLE _reportStop;
+    HANDLE _reportEvent;
+    HANDLE _reportThread;
+    // wave thread instrumentation
+    Counters _stats;
+    LONGLONG _qpcFreq;
+    // frames handed to the device since open()
+    LONGLONG volatile _framesSubmitted;
+    // user supplied info
+    WaveInfo _info;
+    // error code
+    uint32_t _error;
+};
+
+namespace {
+uintptr_t alignPtr(uintptr_t ptr, const uintptr_t align)
+{
+    const uintptr_t offset = align - 1;
+    const uintptr_t mask = ~(align - 1);
+    return (ptr + offset) & mask;
+}
+
+bool isPowerOfTwo(size_t in)
+{
+    return 0 == (in & (in - 1));
+}
+
+// default and upper limit for the number of periods in the ring
+const uint32_t defaultBuffers = 4;
+const uint32_t maxBuffers = 256;
+
+// adaptive queue limits, the shallowest queue that can still double buffer
+// and how long it must run without an underrun before it shrinks
+const uint32_t minDepth = 2;
+const uint32_t stableSeconds = 10;
+
+// fill in the ring layout defaults so everything after can rely on it
+void resolveRing(WaveInfo& info)
+{
+    if (info.numBuffers == 0) {
+        info.numBuffers = defaultBuffers;
+    }
+    if (info.periodSize == 0) {
+        info.periodSize = info.bufferSize / info.numBuffers;
+    }
+    info.bufferSize = info.periodSize * info.numBuffers;
+}
+
+// alignment of each period in the header ring, 128 bits unless asked for more
+size_t ringAlign(const WaveInfo& info)
+{
+    return info.bufferAlign ? info.bufferAlign : 16;
+}
+
+// bytes between periods, rounded up so every period stays aligned
+size_t ringStride(const WaveInfo& info)
+{
+    const size_t hdrBytes = info.periodSize * info.channels * info.bitDepth / 8;
+    return alignPtr(hdrBytes, ringAlign(info));
+}
+
+// KSDATAFORMAT_SUBTYPE_PCM and _IEEE_FLOAT, defined here so ksguid.lib is
+// not needed
+const GUID pcmSubFormat = {
+    0x00000001, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 }
+};
+const GUID floatSubFormat = {
+    0x00000003, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 }
+};
+
+// speaker layout windows assumes for a given channel count
+DWORD defaultChannelMask(uint32_t channels)
+{
+    const DWORD front = SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT;
+    const DWORD back = SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT;
+    const DWORD side = SPEAKER_SIDE_LEFT | SPEAKER_SIDE_RIGHT;
+    const DWORD centre = SPEAKER_FRONT_CENTER | SPEAKER_LOW_FREQUENCY;
+    switch (channels) {
+    case 1:
+        return SPEAKER_FRONT_CENTER;
+    case 2:
+        return front;
+    case 3:
+        return front | SPEAKER_FRONT_CENTER;
+    case 4:
+        return front | back;
+    case 5:
+        return front | SPEAKER_FRONT_CENTER | back;
+    case 6:
+        return front | centre | back;
+    case 7:
+        return front | centre | SPEAKER_BACK_CENTER | side;
+    default:
+        return front | centre | back | side;
+    }
+}
+
+uint32_t countBits(uint32_t in)
+{
+    uint32_t count = 0;
+    for (; in; in &= in - 1) {
+        ++count;
+    }
+    return count;
+}
+
+// plain pcm is kept for anything it can describe since some older drivers
+// never learned the extensible format
+bool needsExtensible(const WaveInfo& info)
+{
+    return info.channels > 2 || info.bitDepth > 16 || info.channelMask ||
+           info.sampleFormat == PW_SAMPLE_FLOAT;
+}
+
+// device format checks shared by output and capture
+bool validFormat(const WaveInfo& info)
+{
+    switch (info.sampleFormat) {
+    case PW_SAMPLE_INT:
+        if (info.bitDepth != 8 && info.bitDepth != 16 && info.bitDepth != 24 &&
+            info.bitDepth != 32) {
+            return false;
+        }
+        break;
+    case PW_SAMPLE_FLOAT:
+        if (info.bitDepth != 32) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+    // any rate the device accepts, the driver rejects what it can't play
+    if (info.sampleRate < 8000 || info.sampleRate > 384000) {
+        return false;
+    }
+    if (info.channels < 1 || info.channels > 8) {
+        return false;
+    }
+    if (info.channelMask && countBits(info.channelMask) != info.channels) {
+        return false;
+    }
+    return true;
+}
+
+void makeWaveFormat(const WaveInfo& info, WAVEFORMATEXTENSIBLE& waveformat)
+{
+    memset(&waveformat, 0, sizeof(waveformat));
+    WAVEFORMATEX& format = waveformat.Format;
+    format.cbSize = 0;
+    format.wFormatTag = WAVE_FORMAT_PCM;
+    format.nChannels = info.channels;
+    format.nSamplesPerSec = info.sampleRate;
+    format.wBitsPerSample = info.bitDepth;
+    format.nBlockAlign = (info.channels * format.wBitsPerSample) / 8;
+    format.nAvgBytesPerSec = info.sampleRate * format.nBlockAlign;
+    if (needsExtensible(info)) {
+        format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+        format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+        waveformat.Samples.wValidBitsPerSample = info.bitDepth;
+        waveformat.dwChannelMask =
+            info.channelMask ? info.channelMask : defaultChannelMask(info.channels);
+        waveformat.SubFormat =
+            (info.sampleFormat == PW_SAMPLE_FLOAT) ? floatSubFormat : pcmSubFormat;
+    }
+}
+
+// convert a number of frames to wasapi 100ns reference time units
+REFERENCE_TIME framesToRefTime(UINT32 frames, uint32_t sampleRate)
+{
+    const REFERENCE_TIME units = 10000000;
+    return (units * frames + sampleRate - 1) / sampleRate;
+}
+
+// and back, rounding up so a whole device period is covered
+UINT32 refTimeToFrames(REFERENCE_TIME time, uint32_t sampleRate)
+{
+    const REFERENCE_TIME units = 10000000;
+    return UINT32((time * sampleRate + units - 1) / units);
+}
+
+void putU16(uint8_t*& out, uint16_t value)
+{
+    out[0] = uint8_t(value);
+    out[1] = uint8_t(value >> 8);
+    out += 2;
+}
+
+void putU32(uint8_t*& out, uint32_t value)
+{
+    putU16(out, uint16_t(value));
+    putU16(out, uint16_t(value >> 16));
+}
+
+void putTag(uint8_t*& out, const char* tag)
+{
+    memcpy(out, tag, 4);
+    out += 4;
+}
+
+// riff header for a wav file, the canonical 44 bytes for plain pcm or 68
+// bytes when the fmt chunk carries the extensible fields
+const uint32_t maxWavHeaderSize = 68;
+
+uint32_t wavHeaderSize(const WaveInfo& info)
+{
+    return needsExtensible(info) ? 68 : 44;
+}
+
+bool writeWavHeader(HANDLE file, const WaveInfo& info, uint32_t dataBytes)
+{
+    WAVEFORMATEXTENSIBLE ext;
+    makeWaveFormat(info, ext);
+    const WAVEFORMATEX& fmt = ext.Format;
+    const uint32_t headerSize = wavHeaderSize(info);
+    uint8_t header[maxWavHeaderSize];
+    uint8_t* out = header;
+    putTag(out, "RIFF");
+    putU32(out, headerSize - 8 + dataBytes);
+    putTag(out, "WAVE");
+    putTag(out, "fmt ");
+    putU32(out, fmt.cbSize ? 18 + fmt.cbSize : 16);
+    putU16(out, fmt.wFormatTag);
+    putU16(out, fmt.nChannels);
+    putU32(out, fmt.nSamplesPerSec);
+    putU32(out, fmt.nAvgBytesPerSec);
+    putU16(out, fmt.nBlockAlign);
+    putU16(out, fmt.wBitsPerSample);
+    if (fmt.cbSize) {
+        putU16(out, fmt.cbSize);
+        putU16(out, ext.Samples.wValidBitsPerSample);
+        putU32(out, ext.dwChannelMask);
+        // guids are stored as their in memory layout on little endian
+        memcpy(out, &ext.SubFormat, sizeof(GUID));
+        out += sizeof(GUID);
+    }
+    putTag(out, "data");
+    putU32(out, dataBytes);
+    assert(out == header + headerSize);
+    DWORD written = 0;
+    return WriteFile(file, header, headerSize, &written, NULL) && written == headerSize;
+}
+
+template <typename type_t>
+void safeRelease(type_t*& ptr)
+{
+    if (ptr) {
+        ptr->Release();
+        ptr = NULL;
+    }
+}
+
+// device 0 is the default endpoint, others index the active endpoints
+HRESULT findEndpoint(
+    IMMDeviceEnumerator* enumerator, EDataFlow flow, uint32_t device, IMMDevice** out)
+{
+    if (device == 0) {
+        return enumerator->GetDefaultAudioEndpoint(flow, eConsole, out);
+    }
+    IMMDeviceCollection* devices = NULL;
+    HRESULT hr = enumerator->EnumAudioEndpoints(flow, DEVICE_STATE_ACTIVE, &devices);
+    if (SUCCEEDED(hr)) {
+        hr = devices->Item(device - 1, out);
+    }
+    safeRelease(devices);
+    return hr;
+}
+}
+
+void Detail::_render(void* buffer, size_t bufferSize)
+{
+    // time the whole period including any format conversion
+    const LONGLONG begin = qpcNow();
+    _controls.drain(_stats.swaps);
+    _fill(buffer, bufferSize);
+    const LONGLONG ticks = qpcNow() - begin;
+    _stats.callback.add(ticks);
+    _checkDeadline(begin, ticks, bufferSize);
+}
+
+void Detail::_checkDeadline(LONGLONG begin, LONGLONG ticks, size_t bufferSize)
+{
+    // the period plays for its frame count at the device rate
+    const LONGLONG budget =
+        LONGLONG(bufferSize / _blockAlign()) * _qpcFreq / LONGLONG(_info.sampleRate);
+    if (budget <= 0) {
+        return;
+    }
+    LONGLONG bucket = (ticks * 4) / budget;
+    if (bucket >= PW_HISTOGRAM_BUCKETS) {
+        bucket = PW_HISTOGRAM_BUCKETS - 1;
+    }
+    InterlockedIncrement64(&_stats.histogram[bucket]);
+    if (ticks <= budget) {
+        return;
+    }
+    InterlockedIncrement64(&_stats.misses);
+    if (_reportThread == NULL) {
+        return;
+    }
+    WaveDeadline report;
+    report.period = uint64_t(_stats.submitted);
+    report.qpcTime = begin;
+    report.renderUs = 1000000.0 * double(ticks) / double(_qpcFreq);
+    report.budgetUs = 1000000.0 * double(budget) / double(_qpcFreq);
+    // drop the report rather than wait if the reporter is behind
+    if (_reportRing.space() >= sizeof(report)) {
+        _reportRing.write(&report, sizeof(report));
+        SetEvent(_reportEvent);
+    }
+}
+
+bool Detail::_openSource()
+{
+    if (!_wavSource.open(_info.sourcePath)) {
+        _error = PW_FILE_ERROR;
+        return false;
+    }
+    // the file is copied out as it is so it must be what the callback
+    // would have rendered
+    const bool isFloat = _info.callbackFormat == PW_CALLBACK_FLOAT32;
+    const uint32_t rate = (isFloat && _info.contentRate) ? _info.contentRate : _info.sampleRate;
+    const uint32_t format = isFloat ? uint32_t(PW_SAMPLE_FLOAT) : _info.sampleFormat;
+    const uint32_t bitDepth = isFloat ? 32 : _info.bitDepth;
+    if (_wavSource.sampleRate != rate || _wavSource.channels != _info.channels ||
+        _wavSource.sampleFormat != format || _wavSource.bitDepth != bitDepth) {
+        _wavSource.close();
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool Detail::_openReports()
+{
+    const uint32_t numReports = 64;
+    _reportRing.init(numReports * sizeof(WaveDeadline));
+    _reportStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+    _reportEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (_reportStop == NULL || _reportEvent == NULL) {
+        _error = PW_CREATEEVENT_ERROR;
+        return false;
+    }
+    // normal priority, it only forwards reports to the user
+    _reportThread = CreateThread(NULL, 0, _reportProc, this, 0, 0);
+    if (_reportThread == NULL) {
+        _error = PW_CREATETHREAD_ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool Detail::_closeReports()
+{
+    if (_reportThread) {
+        // it drains whatever is queued before it exits, a slow deadlineProc
+        // delays close() rather than leaving it running on freed memory
+        SetEvent(_reportStop);
+        WaitForSingleObject(_reportThread, INFINITE);
+        CloseHandle(_reportThread);
+        _reportThread = NULL;
+    }
+    if (_reportStop) {
+        CloseHandle(_reportStop);
+        _reportStop = NULL;
+    }
+    if (_reportEvent) {
+        CloseHandle(_reportEvent);
+        _reportEvent = NULL;
+    }
+    _reportRing.release();
+    return true;
+}
+
+DWORD WINAPI Detail::_reportProc(LPVOID param)
+{
+    assert(param);
+    Detail& self = *(Detail*)param;
+    HANDLE events[2] = { self._reportStop, self._reportEvent };
+    for (;;) {
+        const DWORD which = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+        WaveDeadline report;
+        while (self._reportRing.used() >= sizeof(report)) {
+            self._reportRing.read(&report, sizeof(report));
+            self._info.deadlineProc(report, self._info.deadlineData);
+        }
+        if (which != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+    }
+    return 0;
+}
+
+void Detail::_fill(void* buffer, size_t bufferSize)
+{
+    if (_info.callbackFormat == PW_CALLBACK_FLOAT32) {
+        // render into the staging buffer and convert once to the device
+        const size_t numSamples = bufferSize / (_info.bitDepth / 8);
+        DitherState* dither = (_info.dither == PW_DITHER_TPDF) ? &_dither : NULL;
+        const size_t numFrames = numSamples / _info.channels;
+        if (_info.fadeFrames && _fadeGain == 0.f && !atomicLoad(_fadeTarget)) {
+            // faded out, keep the device fed without calling the user
+            memset(_floatBuffer, 0, numSamples * sizeof(float));
+        } else {
+            if (_resampler.valid()) {
+                _resample(_floatBuffer, numFrames);
+            } else {
+                _source(_floatBuffer, numSamples * sizeof(float));
+            }
+            if (_info.fadeFrames) {
+                _fade(_floatBuffer, numFrames);
+            }
+            if (_controls.hasGain()) {
+                _controls.applyGain(_ramp, _floatBuffer, numFrames, _info.channels);
+            }
+        }
+        {
+            PW_TRACE_ZONE("picowave convert");
+            _convert(_floatBuffer, buffer, numSamples, dither);
+        }
+        return;
+    }
+    _source(buffer, bufferSize);
+}
+
+void Detail::_resample(float* buffer, size_t numFrames)
+{
+    // render fixed size blocks at the content rate until a period is buffered
+    const size_t block = _resampler.block();
+    while (!_resampler.ready(numFrames)) {
+        _source(_contentBuffer, block * _info.channels * sizeof(float));
+        _resampler.push(_contentBuffer, block);
+    }
+    _resampler.pull(buffer, numFrames);
+}
+
+void Detail::_fade(float* buffer, size_t numFrames)
+{
+    const float target = atomicLoad(_fadeTarget) ? 1.f : 0.f;
+    if (_fadeGain == 1.f && target == 1.f) {
+        return;
+    }
+    // linear ramp toward the target, one step per frame, the frame that
+    // would step past it plays at the target and the gain holds from there
+    const float step = 1.f / float(_info.fadeFrames);
+    const uint32_t channels = _info.channels;
+    const size_t needed = size_t(ceilf(fabsf(target - _fadeGain) / step));
+    size_t ramp = 0;
+    if (needed) {
+        ramp = needed <= numFrames ? needed - 1 : numFrames;
+        _fadeGain = _ramp(buffer, ramp, channels, _fadeGain, target > _fadeGain ? step : -step);
+        if (ramp < numFrames) {
+            _fadeGain = target;
+        }
+    }
+    scaleSamples(buffer + ramp * channels, (numFrames - ramp) * channels, _fadeGain);
+}
+
+void Detail::_source(void* buffer, size_t bufferSize)
+{
+    if (_pushRing.valid() || _wavSource.valid()) {
+        // copy out what the producer has queued and pad any shortfall, a
+        // file in the render format is copied straight into the buffer
+        const size_t got = _wavSource.valid()
+                               ? _wavSource.read(buffer, bufferSize, _info.sourceLoop != 0)
+                               : _pushRing.read(buffer, bufferSize);
+        if (got < bufferSize) {
+            const bool unsigned8 =
+                _info.bitDepth == 8 && _info.callbackFormat == PW_CALLBACK_PCM;
+            memset((uint8_t*)buffer + got, unsigned8 ? 0x80 : 0, bufferSize - got);
+        }
+        return;
+    }
+    // call user function to fill with new samples
+    if (_controls.callback) {
+        PW_TRACE_ZONE("picowave callback");
+        _controls.callback(buffer, bufferSize, _controls.callbackData);
+    }
+}
+
+bool Detail::_service()
+{
+    if (_isWasapi()) {
+        return _serviceWasapi();
+    }
+    if (_isNull()) {
+        return _serviceNull();
+    }
+    return _serviceWaveOut();
+}
+
+bool Detail::_allocate()
+{
+    const size_t alignment = ringAlign(_info);
+    // bytes for each waveheader
+    const size_t hdrBytes = _info.periodSize * _info.channels * _info.bitDepth / 8;
+    const size_t hdrStride = ringStride(_info);
+    // full buffer amount requested in bytes
+    const size_t numBytes = hdrStride * _info.numBuffers;
+    uint8_t* ptr = (uint8_t*)_info.bufferMemory;
+    if (ptr == NULL) {
+        // allocate with room for alignment
+        _rawAlloc = new uint8_t[numBytes + alignment];
+        // align the allocation
+        ptr = (uint8_t*)alignPtr((uintptr_t)_rawAlloc, alignment);
+    }
+    memset(ptr, (_info.bitDepth == 8) ? 0x80 : 0, numBytes);
+    // one header for each period in the ring
+    _wavehdr.resize(_info.numBuffers);
+    _head = 0;
+    _inFlight = 0;
+
+    for (WAVEHDR& hdr : _wavehdr) {
+        // check alignment holds
+        assert(0 == ((uintptr_t)ptr & (alignment - 1)));
+        // allocate the wave header object
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.lpData = (LPSTR)ptr;
+        hdr.dwBufferLength = hdrBytes;
+        // next chunk of samples for the next waveheader
+        ptr += hdrStride;
+    }
+    return true;
+}
+
+bool Detail::_prepare(bool write)
+{
+    PW_TRACE_ZONE("picowave prepare");
+    assert(_hwo);
+    const LONGLONG begin = qpcNow();
+    const LONGLONG submitted = _stats.submitted;
+    const uint32_t depth = atomicLoad(_depth);
+    for (WAVEHDR& hdr : _wavehdr) {
+        // prepare the header for the device
+        if (!MMOK(waveOutPrepareHeader(_hwo, &hdr, sizeof(hdr)))) {
+            _error = PW_WAVEOUTPREPHDR_ERROR;
+            return false;
+        }
+        // with preroll the first write waits for start() to render it
+        if (!write || _inFlight >= depth) {
+            continue;
+        }
+        // write the buffer to the device
+        if (!_writeHeader(hdr)) {
+            _error = PW_WAVEOUTWRITE_ERROR;
+            return false;
+        }
+        _countSubmit(_info.periodSize);
+        ++_inFlight;
+    }
+    // the silence counts as one submit pass, the same as a wake would
+    if (_stats.submitted != submitted) {
+        _stats.submit.add(qpcNow() - begin);
+    }
+    _primed = write;
+    return true;
+}
+
+// every period handed to a device goes through here so buffersSubmitted,
+// the deadline period index and the position clock agree
+void Detail::_countSubmit(uint32_t frames)
+{
+    InterlockedIncrement64(&_stats.submitted);
+    InterlockedExchangeAdd64(&_framesSubmitted, frames);
+}
+
+bool Detail::_preroll()
+{
+    // the thread is parked so rendering from here does not race it
+    if (_hwo) {
+        const uint32_t depth = atomicLoad(_depth);
+        while (_inFlight < depth) {
+            WAVEHDR& hdr = _wavehdr[(_head + _inFlight) % _wavehdr.size()];
+            _render(hdr.lpData, hdr.dwBufferLength);
+            if (!_writeHeader(hdr)) {
+                _error = PW_WAVEOUTWRITE_ERROR;
+                return false;
+            }
+            _countSubmit(_info.periodSize);
+            ++_inFlight;
+        }
+    }
+    if (_audioClient) {
+        // the endpoint buffer is empty so this fills all of it
+        if (!_serviceWasapi()) {
+            _error = PW_WASAPI_BUFFER_ERROR;
+            return false;
+        }
+    }
+    _primed = true;
+    return true;
+}
+
+bool Detail::_serviceWaveOut()
+{
+    assert(_hwo);
+    const size_t numBuffers = _wavehdr.size();
+    // the device returns headers in the order they were written so retire
+    // them strictly from the head of the ring
+    size_t numDone = 0;
+    {
+        PW_TRACE_ZONE("picowave retire");
+        while (_inFlight && (_wavehdr[_head].dwFlags & WHDR_DONE)) {
+            _head = (_head + 1) % numBuffers;
+            --_inFlight;
+            ++numDone;
+        }
+    }
+    // more than one finished header means we woke late
+    const bool late = numDone > 1;
+    if (late) {
+        InterlockedIncrement64(&_stats.underruns);
+    }
+    // a header finishing ahead of the head would mean the device completed
+    // out of order, checking the next one is enough to notice it
+    if (_inFlight > 1) {
+        const WAVEHDR& next = _wavehdr[(_head + 1) % numBuffers];
+        if ((_wavehdr[_head].dwFlags & WHDR_DONE) == 0 && (next.dwFlags & WHDR_DONE)) {
+            InterlockedIncrement64(&_stats.outOfOrder);
+        }
+    }
+    if (numDone) {
+        _adapt(late);
+    }
+    // top the queue back up to the current depth, when the depth has just
+    // shrunk this writes nothing and the queue drains by a period
+    const uint32_t depth = atomicLoad(_depth);
+    while (_inFlight < depth) {
+        // headers stay prepared for the life of the device so they can be
+        // written straight back once refilled
+        WAVEHDR& hdr = _wavehdr[(_head + _inFlight) % numBuffers];
+        _render(hdr.lpData, hdr.dwBufferLength);
+        if (!_writeHeader(hdr)) {
+            return false;
+        }
+        _countSubmit(_info.periodSize);
+        ++_inFlight;
+    }
+    PW_TRACE_COUNTER("picowave queue depth", _inFlight);
+    return true;
+}
+
+bool Detail::_writeHeader(WAVEHDR& hdr)
+{
+    PW_TRACE_ZONE("picowave waveOutWrite");
+    return MMOK(waveOutWrite(_hwo, &hdr, sizeof(hdr)));
+}
+
+void Detail::_adapt(bool late)
+{
+    if (!_info.adaptive) {
+        return;
+    }
+    uint32_t depth = _depth;
+    if (late) {
+        // grow straight away, the extra period is rendered on this wake
+        if (depth < _info.numBuffers) {
+            ++depth;
+        }
+        _stableWakes = 0;
+    } else if (++_stableWakes >= _shrinkWakes && depth > _depthFloor) {
+        // give latency back slowly, one period per stable stretch
+        --depth;
+        _stableWakes = 0;
+    }
+    atomicStore(_depth, depth);
+}
+
+bool Detail::_serviceWasapi()
+{
+    assert(_audioClient && _renderClient);
+    // in exclusive event mode each event hands us the whole buffer, in shared
+    // mode we must ask how much the engine has yet to consume
+    UINT32 padding = 0;
+    if (_info.backend == PW_BACKEND_WASAPI_SHARED) {
+        if (FAILED(_audioClient->GetCurrentPadding(&padding))) {
+            return false;
+        }
+    }
+    const UINT32 blockAlign = _blockAlign();
+    // adaptive mode keeps only depth periods queued in the endpoint buffer
+    UINT32 target = _bufferFrames;
+    if (_info.adaptive && _info.backend == PW_BACKEND_WASAPI_SHARED) {
+        const UINT32 depthFrames = UINT32(atomicLoad(_depth)) * _periodFrames;
+        target = depthFrames < _bufferFrames ? depthFrames : _bufferFrames;
+    }
+    UINT32 available = target > padding ? target - padding : 0;
+    // the engine takes a whole device period at a time, so an empty endpoint
+    // buffer or more than one engine pass plus a period to refill means we
+    // woke late, ignoring the very first wake where the buffer starts empty
+    const UINT32 pass = _engineFrames > _periodFrames ? _engineFrames : _periodFrames;
+    const bool late = (padding == 0 || available >= pass + _periodFrames) &&
+                      _info.backend == PW_BACKEND_WASAPI_SHARED;
+    if (late && atomicLoad64(_stats.submitted)) {
+        InterlockedIncrement64(&_stats.underruns);
+        _adapt(true);
+    } else if (available >= _periodFrames) {
+        _adapt(false);
+    }
+    // render whole periods only so the callback always sees the same size
+    while (available >= _periodFrames) {
+        BYTE* data = NULL;
+        if (FAILED(_renderClient->GetBuffer(_periodFrames, &data))) {
+            return false;
+        }
+        _render(data, _periodFrames * blockAlign);
+        if (FAILED(_renderClient->ReleaseBuffer(_periodFrames, 0))) {
+            return false;
+        }
+        _countSubmit(_periodFrames);
+        available -= _periodFrames;
+    }
+    PW_TRACE_COUNTER("picowave queue depth", (target - available) / _periodFrames);
+    return true;
+}
+
+bool Detail::_serviceNull()
+{
+    const size_t numBuffers = _wavehdr.size();
+    // without a clock we render a single period per wake and wake ourselves
+    // straight back up so pause and close are still seen between periods
+    size_t due = 1;
+    if (_info.backend == PW_BACKEND_NULL_CLOCKED) {
+        // work out how many periods the simulated device has consumed
+        const LONGLONG elapsed = qpcNow() - atomicLoad64(_clockStart);
+        const LONGLONG target =
+            (elapsed * _info.sampleRate) / (_qpcFreq * _info.periodSize);
+        due = (target > _clockPeriods) ? size_t(target - _clockPeriods) : 0;
+        if (due > 1) {
+            InterlockedIncrement64(&_stats.underruns);
+        }
+        if (due > numBuffers) {
+            // a real device would have played silence for the periods we
+            // could not have queued in time
+            _clockPeriods += due - numBuffers;
+            due = numBuffers;
+        }
+    }
+    for (size_t i = 0; i < due; ++i) {
+        WAVEHDR& hdr = _wavehdr[_head];
+        _render(hdr.lpData, hdr.dwBufferLength);
+        if (_wavFile != INVALID_HANDLE_VALUE) {
+            DWORD written = 0;
+            if (!WriteFile(_wavFile, hdr.lpData, hdr.dwBufferLength, &written, NULL)) {
+                return false;
+            }
+            _wavBytes += written;
+        }
+        _countSubmit(_info.periodSize);
+        _head = (_head + 1) % numBuffers;
+        ++_clockPeriods;
+    }
+    if (_info.backend == PW_BACKEND_NULL) {
+        SetEvent(_waveEvent);
+    }
+    return true;
+}
+
+bool Detail::_wake()
+{
+    PW_TRACE_ZONE("picowave wake");
+    // the endpoint went away or the default moved, follow it
+    if (_watch && _watch->takeChanged()) {
+        return _recover();
+    }
+    // take the captured periods first so the render can already use them
+    {
+        ScopedLock lock(_captureLock);
+        if (_capture) {
+            _capture->service();
+        }
+    }
+    const LONGLONG wake = qpcNow();
+    const LONGLONG submitted = _stats.submitted;
+    // refill any buffers the device has finished with, a failure here is
+    // almost always the device having been removed
+    if (!_service()) {
+        return _recover();
+    }
+    if (_stats.submitted != submitted) {
+        _stats.submit.add(qpcNow() - wake);
+    }
+    PW_TRACE_COUNTER("picowave period", _stats.submitted);
+    return true;
+}
+
+bool Detail::attachCapture(InDetail* capture)
+{
+    ScopedLock lock(_captureLock);
+    if (capture && _capture) {
+        return false;
+    }
+    _capture = capture;
+    return true;
+}
+
+DWORD WINAPI Detail::_threadProc(LPVOID param)
+{
+    assert(param);
+    Detail& self = *(Detail*)param;
+    ThreadScope scope(self._isWasapi(), self._info.priority);
+    PW_TRACE_THREAD("picowave wave");
+    // the stop event comes first so it wins when both are signalled
+    HANDLE events[2] = { self._stopEvent, self._waveEvent };
+    for (;;) {
+        const DWORD which = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+        if (which != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+        // parked while paused, the device holds whatever is queued
+        if (!atomicLoad(self._running)) {
+            continue;
+        }
+        if (!self._wake()) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool Detail::_validate(const WaveInfo& info)
+{
+    const uint32_t numBuffers = info.numBuffers ? info.numBuffers : defaultBuffers;
+    if (numBuffers < 2 || numBuffers > maxBuffers) {
+        return false;
+    }
+    if (info.periodSize == 0) {
+        // the buffer must split evenly into non empty periods
+        if (!isPowerOfTwo(info.bufferSize) || info.bufferSize < numBuffers) {
+            return false;
+        }
+        if (info.bufferSize % numBuffers) {
+            return false;
+        }
+    }
+    if (info.sourcePath && (info.callback || info.pushSize)) {
+        return false;
+    }
+    if (info.callback == nullptr && info.pushSize == 0 && info.sourcePath == nullptr) {
+        // direct mode, the caller renders in place through acquire() so
+        // there is nothing for a service thread or float staging to do
+        if (info.group || info.preroll || info.contentRate || info.fadeFrames ||
+            info.adaptive || info.deadlineProc || info.callbackFormat != PW_CALLBACK_PCM) {
+            return false;
+        }
+        if (info.backend != PW_BACKEND_WAVEOUT && info.backend != PW_BACKEND_WASAPI_SHARED &&
+            info.backend != PW_BACKEND_WASAPI_EXCLUSIVE) {
+            return false;
+        }
+    }
+    if (info.bufferAlign && (!isPowerOfTwo(info.bufferAlign) || info.bufferAlign > 65536)) {
+        return false;
+    }
+    if (info.bufferMemory) {
+        // caller memory must hold the whole ring at the requested alignment
+        if ((uintptr_t)info.bufferMemory & (ringAlign(info) - 1)) {
+            return false;
+        }
+        if (info.bufferMemorySize < ringMemorySize(info)) {
+            return false;
+        }
+    }
+    if (info.group && !info.group->_detail->isOpen()) {
+        return false;
+    }
+    // keep the push ring well inside the range of its 32 bit counters
+    if (info.pushSize > (1u << 24)) {
+        return false;
+    }
+    if (!validFormat(info)) {
+        return false;
+    }
+    if (info.contentRate && info.contentRate != info.sampleRate) {
+        // the resampler works on float32 so the callback must render it
+        if (info.callbackFormat != PW_CALLBACK_FLOAT32) {
+            return false;
+        }
+        if (info.contentRate < 8000 || info.contentRate > 384000) {
+            return false;
+        }
+        if (info.resampleQuality > PW_RESAMPLE_BEST) {
+            return false;
+        }
+        if (info.sampleRate / gcd(info.sampleRate, info.contentRate) > maxPhases) {
+            return false;
+        }
+    }
+    switch (info.backend) {
+    case PW_BACKEND_WAVEOUT:
+    case PW_BACKEND_WASAPI_SHARED:
+    case PW_BACKEND_WASAPI_EXCLUSIVE:
+    case PW_BACKEND_NULL:
+    case PW_BACKEND_NULL_CLOCKED:
+        break;
+    default:
+        return false;
+    }
+    if (info.callbackFormat != PW_CALLBACK_PCM &&
+        info.callbackFormat != PW_CALLBACK_FLOAT32) {
+        return false;
+    }
+    if (info.dither != PW_DITHER_NONE && info.dither != PW_DITHER_TPDF) {
+        return false;
+    }
+    // the fade is applied to float32 before conversion
+    if (info.fadeFrames && info.callbackFormat != PW_CALLBACK_FLOAT32) {
+        return false;
+    }
+    switch (info.priority) {
+    case PW_PRIORITY_DEFAULT:
+    case PW_PRIORITY_MMCSS:
+    case PW_PRIORITY_TIME_CRITICAL:
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+bool Detail::open(const WaveInfo& info)
+{
+    // check if already running
+    if (_hwo || _audioClient || _waveThread || _waveEvent || _stopEvent) {
+        _error = PW_ALREADY_OPEN;
+        return false;
+    }
+    if (!_validate(info)) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    // copy wave info structure to internal data for reference
+    _info = info;
+    _stats.reset();
+    InterlockedExchange64(&_framesSubmitted, 0);
+    // the first start() fades in from silence
+    atomicStore(_fadeTarget, 0);
+    _fadeGain = 0.f;
+    _controls.reset(_info.callback, _info.callbackData);
+    resolveRing(_info);
+    // adaptive mode starts at the shallowest queue and grows on demand
+    _depthFloor = minDepth;
+    atomicStore(_depth, _info.adaptive ? _depthFloor : _info.numBuffers);
+    _stableWakes = 0;
+    _shrinkWakes = (stableSeconds * _info.sampleRate) / _info.periodSize;
+    // allocate the push ring rounded up to a power of two
+    if (_info.pushSize) {
+        uint32_t capacity = 1;
+        while (capacity < _info.pushSize * _sourceBlockAlign()) {
+            capacity <<= 1;
+        }
+        _pushRing.init(capacity);
+    }
+    // create waitable wave event, the clocked null backend is instead woken
+    // by a periodic timer standing in for the device
+    if (_info.backend == PW_BACKEND_NULL_CLOCKED) {
+        _waveEvent = CreateWaitableTimerA(NULL, FALSE, NULL);
+    } else {
+        _waveEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    }
+    if (_waveEvent == NULL) {
+        _error = PW_CREATEEVENT_ERROR;
+        return false;
+    }
+    // open the output device
+    bool opened = false;
+    switch (_info.backend) {
+    case PW_BACKEND_WASAPI_SHARED:
+    case PW_BACKEND_WASAPI_EXCLUSIVE:
+        opened = _openWasapi();
+        break;
+    case PW_BACKEND_NULL:
+    case PW_BACKEND_NULL_CLOCKED:
+        opened = _openNull();
+        break;
+    default:
+        opened = _openWaveOut();
+        break;
+    }
+    if (!opened) {
+        return false;
+    }
+    if (_info.callbackFormat == PW_CALLBACK_FLOAT32) {
+        // exclusive wasapi may have aligned the period beyond what was asked
+        const size_t numFrames =
+            _periodFrames > _info.periodSize ? _periodFrames : _info.periodSize;
+        // 256 bits of alignment so the callback and kernels get avx loads
+        const size_t alignment = 32;
+        const size_t numBytes = numFrames * _info.channels * sizeof(float);
+        _floatFrames = numFrames;
+        _floatAlloc = new uint8_t[numBytes + alignment];
+        _floatBuffer = (float*)alignPtr((uintptr_t)_floatAlloc, alignment);
+        memset(_floatBuffer, 0, numBytes);
+        const bool dithered = _info.dither == PW_DITHER_TPDF;
+        _convert = selectConvert(_info.bitDepth, _info.sampleFormat, dithered);
+        _ramp = selectRamp(_info.channels);
+        if (_info.contentRate && _info.contentRate != _info.sampleRate) {
+            if (!_resampler.init(_info.contentRate, _info.sampleRate, _info.channels,
+                    _info.resampleQuality, uint32_t(numFrames))) {
+                _error = PW_WAVEINFO_ERROR;
+                return false;
+            }
+            // the callback renders content in blocks of a fixed size
+            const size_t blockBytes = _resampler.block() * _info.channels * sizeof(float);
+            _contentAlloc = new uint8_t[blockBytes + alignment];
+            _contentBuffer = (float*)alignPtr((uintptr_t)_contentAlloc, alignment);
+            memset(_contentBuffer, 0, blockBytes);
+        }
+        _dither.seed();
+    }
+    // prepare the header ring for playback
+    if (!_isWasapi()) {
+        if (!_allocate() || (!_isNull() && !_prepare(!_info.preroll))) {
+            return false;
+        }
+    }
+    if (_info.deadlineProc && !_openReports()) {
+        return false;
+    }
+    if (_info.sourcePath && !_openSource()) {
+        return false;
+    }
+    if (_info.group) {
+        // join the shared service thread, it skips us until start()
+        if (!_info.group->_detail->add(this)) {
+            _error = PW_GROUP_ERROR;
+            return false;
+        }
+        _group = _info.group->_detail;
+        return true;
+    }
+    if (_isDirect()) {
+        // acquire() and commit() drive the device from the caller's thread
+        return true;
+    }
+    // manual reset so the thread sees it however many times it waits
+    _stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (_stopEvent == NULL) {
+        _error = PW_CREATEEVENT_ERROR;
+        return false;
+    }
+    // create the wave thread
+    _waveThread = CreateThread(
+        NULL, 0, _threadProc, this, CREATE_SUSPENDED, 0);
+    if (_waveThread == NULL) {
+        _error = PW_CREATETHREAD_ERROR;
+        return false;
+    }
+    // the thread is still suspended so it can be configured before it runs
+    _error = configureThread(_waveThread, _info.priority, _info.affinity);
+    // from here on it parks on its event until start(), even on failure so
+    // close() can still join it
+    ResumeThread(_waveThread);
+    return _error == PW_OK;
+}
+
+bool Detail::_openWaveOut()
+{
+    // prepare output wave format
+    WAVEFORMATEXTENSIBLE waveformat;
+    makeWaveFormat(_info, waveformat);
+    // open the requested device directly to avoid the mapper's conversions
+    const UINT deviceId = _info.device ? UINT(_info.device - 1) : WAVE_MAPPER;
+    // create wave output
+    memset(&_hwo, 0, sizeof(_hwo));
+    if (!MMOK(waveOutOpen(
+            &_hwo,
+            deviceId,
+            &waveformat.Format,
+            (DWORD_PTR)_waveEvent,
+            NULL,
+            CALLBACK_EVENT))) {
+        _error = PW_WAVEOUTOPEN_ERROR;
+        return false;
+    }
+    // hold the primed headers until start()
+    if (!MMOK(waveOutPause(_hwo))) {
+        _error = PW_WAVEOUTOPEN_ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool Detail::_openWasapi()
+{
+    // com may already be initialized on this thread in which case we just
+    // borrow it, anything else is a failure
+    const HRESULT hrCom = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (SUCCEEDED(hrCom)) {
+        _comInit = true;
+    } else if (hrCom != RPC_E_CHANGED_MODE) {
+        _error = PW_COINITIALIZE_ERROR;
+        return false;
+    }
+    return _createWasapi(!_info.preroll) && _watchDevice();
+}
+
+bool Detail::_createWasapi(bool prime)
+{
+    // find the requested render endpoint
+    IMMDeviceEnumerator* enumerator = NULL;
+    if (FAILED(CoCreateInstance(
+            __uuidof(MMDeviceEnumerator),
+            NULL,
+            CLSCTX_ALL,
+            __uuidof(IMMDeviceEnumerator),
+            (void**)&enumerator))) {
+        _error = PW_WASAPI_DEVICE_ERROR;
+        return false;
+    }
+    const HRESULT hrDev = findEndpoint(enumerator, eRender, _info.device, &_device);
+    safeRelease(enumerator);
+    if (FAILED(hrDev)) {
+        _error = PW_WASAPI_DEVICE_ERROR;
+        return false;
+    }
+    if (FAILED(_device->Activate(
+            __uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&_audioClient))) {
+        _error = PW_WASAPI_DEVICE_ERROR;
+        return false;
+    }
+    // prepare output wave format
+    WAVEFORMATEXTENSIBLE waveformat;
+    makeWaveFormat(_info, waveformat);
+    const UINT32 periodFrames = _info.periodSize;
+    HRESULT hr = S_OK;
+    if (_info.backend == PW_BACKEND_WASAPI_EXCLUSIVE) {
+        // exclusive event mode requires the buffer duration to equal the
+        // period, the engine double buffers it internally so the ring depth
+        // does not apply
+        REFERENCE_TIME minPeriod = 0;
+        if (FAILED(_audioClient->GetDevicePeriod(NULL, &minPeriod))) {
+            _error = PW_WASAPI_INITIALIZE_ERROR;
+            return false;
+        }
+        REFERENCE_TIME period = framesToRefTime(periodFrames, _info.sampleRate);
+        if (period < minPeriod) {
+            period = minPeriod;
+        }
+        hr = _audioClient->Initialize(
+            AUDCLNT_SHAREMODE_EXCLUSIVE,
+            AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+            period,
+            period,
+            &waveformat.Format,
+            NULL);
+        if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED) {
+            // the device wants a different period, it tells us the aligned
+            // size and we must create a new client to try again with it
+            UINT32 aligned = 0;
+            if (FAILED(_audioClient->GetBufferSize(&aligned))) {
+                _error = PW_WASAPI_INITIALIZE_ERROR;
+                return false;
+            }
+            safeRelease(_audioClient);
+            if (FAILED(_device->Activate(
+                    __uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&_audioClient))) {
+                _error = PW_WASAPI_DEVICE_ERROR;
+                return false;
+            }
+            period = framesToRefTime(aligned, _info.sampleRate);
+            hr = _audioClient->Initialize(
+                AUDCLNT_SHAREMODE_EXCLUSIVE,
+                AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                period,
+                period,
+                &waveformat.Format,
+                NULL);
+        }
+    } else {
+        // shared mode lets the engine convert our format to the mix format
+        const DWORD flags = AUDCLNT_STREAMFLAGS_EVENTCALLBACK |
+                            AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM |
+                            AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY;
+        hr = _audioClient->Initialize(
+            AUDCLNT_SHAREMODE_SHARED,
+            flags,
+            framesToRefTime(_info.bufferSize, _info.sampleRate),
+            0,
+            &waveformat.Format,
+            NULL);
+    }
+    if (FAILED(hr)) {
+        _error = PW_WASAPI_INITIALIZE_ERROR;
+        return false;
+    }
+    if (FAILED(_audioClient->SetEventHandle(_waveEvent))) {
+        _error = PW_WASAPI_INITIALIZE_ERROR;
+        return false;
+    }
+    if (FAILED(_audioClient->GetBufferSize(&_bufferFrames))) {
+        _error = PW_WASAPI_BUFFER_ERROR;
+        return false;
+    }
+    if (FAILED(_audioClient->GetService(
+            __uuidof(IAudioRenderClient), (void**)&_renderClient))) {
+        _error = PW_WASAPI_INITIALIZE_ERROR;
+        return false;
+    }
+    // the stream clock backs position()
+    if (FAILED(_audioClient->GetService(__uuidof(IAudioClock), (void**)&_audioClock))) {
+        _error = PW_WASAPI_INITIALIZE_ERROR;
+        return false;
+    }
+    if (FAILED(_audioClock->GetFrequency(&_audioClockFreq)) || _audioClockFreq == 0) {
+        _error = PW_WASAPI_INITIALIZE_ERROR;
+        return false;
+    }
+    if (_info.backend == PW_BACKEND_WASAPI_EXCLUSIVE) {
+        _periodFrames = _bufferFrames;
+        // exclusive mode must have a buffer queued before the stream starts,
+        // preroll renders it in start() instead
+        if (!prime) {
+            return true;
+        }
+        BYTE* data = NULL;
+        if (FAILED(_renderClient->GetBuffer(_bufferFrames, &data))) {
+            _error = PW_WASAPI_BUFFER_ERROR;
+            return false;
+        }
+        if (FAILED(_renderClient->ReleaseBuffer(
+                _bufferFrames, AUDCLNT_BUFFERFLAGS_SILENT))) {
+            _error = PW_WASAPI_BUFFER_ERROR;
+            return false;
+        }
+        InterlockedExchangeAdd64(&_framesSubmitted, _bufferFrames);
+    } else {
+        _periodFrames = periodFrames < _bufferFrames ? periodFrames : _bufferFrames;
+        // a queue shorter than the engine period plus one of ours starves
+        // the engine on every pass, so adaptive depth never goes below it
+        REFERENCE_TIME enginePeriod = 0;
+        if (FAILED(_audioClient->GetDevicePeriod(&enginePeriod, NULL))) {
+            _error = PW_WASAPI_INITIALIZE_ERROR;
+            return false;
+        }
+        _engineFrames = refTimeToFrames(enginePeriod, _info.sampleRate);
+        uint32_t floor = (_engineFrames + _periodFrames - 1) / _periodFrames + 1;
+        floor = floor < minDepth ? minDepth : floor;
+        _depthFloor = floor < _info.numBuffers ? floor : _info.numBuffers;
+        if (_info.adaptive && atomicLoad(_depth) < _depthFloor) {
+            atomicStore(_depth, _depthFloor);
+        }
+    }
+    return true;
+}
+
+bool Detail::_watchDevice()
+{
+    // without notifications a lost device is still caught when servicing
+    // fails, so none of this is fatal
+    if (FAILED(CoCreateInstance(
+            __uuidof(MMDeviceEnumerator),
+            NULL,
+            CLSCTX_ALL,
+            __uuidof(IMMDeviceEnumerator),
+            (void**)&_enumerator))) {
+        return true;
+    }
+    _watch = new DeviceWatch(_waveEvent, _info.device == 0);
+    wchar_t* id = NULL;
+    if (SUCCEEDED(_device->GetId(&id))) {
+        _watch->setId(id);
+        CoTaskMemFree(id);
+    }
+    if (FAILED(_enumerator->RegisterEndpointNotificationCallback(_watch))) {
+        safeRelease(_watch);
+    }
+    return true;
+}
+
+bool Detail::_recover()
+{
+    // the ring, staging buffers, callback and thread all stay, only the
+    // device is replaced and its ring refilled with fresh audio
+    {
+        ScopedLock lock(_deviceLock);
+        // frames still queued on the old device are never played, so count
+        // only what it last reported
+        WavePosition pos;
+        const uint64_t played = _readPosition(pos) ? pos.framesPlayed : _lastPlayed;
+        _playedBase = played > _playedBase ? played : _playedBase;
+        _submittedBase = uint64_t(atomicLoad64(_framesSubmitted));
+        _recovering = true;
+    }
+    // the reopen and the preroll run the callback for a whole ring, none of
+    // that holds up position(), start() or pause() on other threads
+    bool ok = _reopen();
+    // swap the new device in as running or paused, whichever was asked for
+    // last
+    ScopedLock lock(_deviceLock);
+    _recovering = false;
+    if (ok && atomicLoad(_running)) {
+        if (_hwo) {
+            ok = MMOK(waveOutRestart(_hwo));
+        } else if (_audioClient) {
+            ok = SUCCEEDED(_audioClient->Start());
+        }
+    }
+    if (ok) {
+        InterlockedIncrement64(&_stats.recoveries);
+    } else {
+        // drop whatever the reopen got to so no call finds a half open
+        // device, the service thread stops after this
+        _closeWaveOut();
+        _releaseWasapi();
+        _head = 0;
+        _inFlight = 0;
+        atomicStore(_running, 0);
+        _lost = true;
+        _error = PW_DEVICE_LOST;
+    }
+    return ok;
+}
+
+// called with _deviceLock held
+bool Detail::_checkLost()
+{
+    if (_lost) {
+        _error = PW_DEVICE_LOST;
+    }
+    return _lost;
+}
+
+bool Detail::_reopen()
+{
+    // the null backends have no device to lose
+    if (_isNull()) {
+        return false;
+    }
+    // the backend decides the branch, a handle may already be gone
+    bool ok = false;
+    if (!_isWasapi()) {
+        if (_hwo) {
+            // the old handle may be dead already so only tidy up what we can
+            waveOutReset(_hwo);
+            for (WAVEHDR& hdr : _wavehdr) {
+                waveOutUnprepareHeader(_hwo, &hdr, sizeof(hdr));
+            }
+            waveOutClose(_hwo);
+            _hwo = NULL;
+        }
+        _head = 0;
+        _inFlight = 0;
+        ok = _openWaveOut() && _prepare(false) && _preroll();
+    } else {
+        _releaseWasapi();
+        ok = _createWasapi(false);
+        if (ok && _watch) {
+            wchar_t* id = NULL;
+            if (SUCCEEDED(_device->GetId(&id))) {
+                _watch->setId(id);
+                CoTaskMemFree(id);
+            }
+        }
+        // an exclusive device may want a longer period than we can stage
+        if (ok && _floatBuffer && _periodFrames > _floatFrames) {
+            ok = false;
+        }
+        ok = ok && _preroll();
+    }
+    return ok;
+}
+
+bool Detail::_openNull()
+{
+    _clockPeriods = 0;
+    _wavBytes = 0;
+    if (_info.wavPath == NULL) {
+        return true;
+    }
+    _wavFile = CreateFileA(
+        _info.wavPath,
+        GENERIC_WRITE,
+        FILE_SHARE_READ,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+    if (_wavFile == INVALID_HANDLE_VALUE) {
+        _error = PW_FILE_ERROR;
+        return false;
+    }
+    // sizes are patched in when the file is closed
+    if (!writeWavHeader(_wavFile, _info, 0)) {
+        _error = PW_FILE_ERROR;
+        return false;
+    }
+    return true;
+}
+
+bool Detail::close()
+{
+    atomicStore(_running, 0);
+    _primed = false;
+    _acquired = false;
+    _submittedBase = 0;
+    _playedBase = 0;
+    _lastPlayed = 0;
+    _lost = false;
+    if (_group) {
+        // once this returns the group thread will not service us again
+        _group->remove(this);
+        _group = NULL;
+    }
+    atomicStore(_failed, 0);
+    {
+        // the capture should have been closed first, it stops being serviced
+        ScopedLock lock(_captureLock);
+        if (_capture) {
+            _capture->detach();
+            _capture = NULL;
+        }
+    }
+    if (_waveThread) {
+        // the thread wakes straight away so this only waits for a callback
+        // that is already running to return. it is never killed as the
+        // callback may hold user locks, and never abandoned as the destructor
+        // frees everything it uses once close() returns
+        SetEvent(_stopEvent);
+        WaitForSingleObject(_waveThread, INFINITE);
+        CloseHandle(_waveThread);
+        _waveThread = NULL;
+    }
+    // nothing renders now, so the last reports are already queued
+    if (!_closeReports()) {
+        return false;
+    }
+    if (!_closeWaveOut() || !_closeWasapi() || !_closeNull()) {
+        return false;
+    }
+    if (_stopEvent) {
+        CloseHandle(_stopEvent);
+        _stopEvent = NULL;
+    }
+    if (_waveEvent) {
+        if (CloseHandle(_waveEvent) == FALSE) {
+            _error = PW_CLOSEHANDLE_ERROR;
+        }
+        _waveEvent = NULL;
+    }
+    _wavehdr.clear();
+    _pushRing.release();
+    _wavSource.close();
+    memset(&_info, 0, sizeof(_info));
+    // release the raw allocation
+    if (_rawAlloc) {
+        delete[] _rawAlloc;
+        _rawAlloc = NULL;
+    }
+    if (_floatAlloc) {
+        delete[] _floatAlloc;
+        _floatAlloc = NULL;
+        _floatBuffer = NULL;
+        _floatFrames = 0;
+    }
+    if (_contentAlloc) {
+        delete[] _contentAlloc;
+        _contentAlloc = NULL;
+        _contentBuffer = NULL;
+    }
+    _resampler.release();
+    _convert = NULL;
+    _ramp = NULL;
+    return true;
+}
+
+bool Detail::_closeWaveOut()
+{
+    if (_hwo) {
+        // return any queued headers so they can be unprepared
+        waveOutReset(_hwo);
+        for (WAVEHDR& hdr : _wavehdr) {
+            if (hdr.dwFlags & WHDR_PREPARED) {
+                waveOutUnprepareHeader(_hwo, &hdr, sizeof(hdr));
+            }
+        }
+        if (!MMOK(waveOutClose(_hwo))) {
+            _error = PW_WAVEOUTCLOSE_ERROR;
+            return false;
+        }
+        _hwo = NULL;
+    }
+    return true;
+}
+
+void Detail::_releaseWasapi()
+{
+    if (_audioClient) {
+        _audioClient->Stop();
+    }
+    safeRelease(_audioClock);
+    safeRelease(_renderClient);
+    safeRelease(_audioClient);
+    safeRelease(_device);
+    _bufferFrames = 0;
+    _periodFrames = 0;
+}
+
+bool Detail::_closeWasapi()
+{
+    if (_enumerator && _watch) {
+        _enumerator->UnregisterEndpointNotificationCallback(_watch);
+    }
+    safeRelease(_watch);
+    safeRelease(_enumerator);
+    _releaseWasapi();
+    if (_comInit) {
+        CoUninitialize();
+        _comInit = false;
+    }
+    return true;
+}
+
+bool Detail::_closeNull()
+{
+    if (_wavFile != INVALID_HANDLE_VALUE) {
+        // go back and fill in the final chunk sizes
+        const uint32_t limit = 0xffffffffu - wavHeaderSize(_info);
+        const uint32_t dataBytes = (_wavBytes > limit) ? limit : uint32_t(_wavBytes);
+        bool ok = SetFilePointer(_wavFile, 0, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER;
+        ok = ok && writeWavHeader(_wavFile, _info, dataBytes);
+        if (CloseHandle(_wavFile) == FALSE) {
+            ok = false;
+        }
+        _wavFile = INVALID_HANDLE_VALUE;
+        if (!ok) {
+            _error = PW_FILE_ERROR;
+            return false;
+        }
+    }
+    return true;
+}
+
+void Detail::_kick()
+{
+    // waveOut shrugs off a spurious wake, the null backend needs one to get
+    // going, wasapi and the clocked null backend are woken by their device
+    if (_info.backend == PW_BACKEND_WAVEOUT || _info.backend == PW_BACKEND_NULL) {
+        SetEvent(_waveEvent);
+    }
+}
+
+bool Detail::start()
+{
+    if (!_isOpen()) {
+        return false;
+    }
+    ScopedLock lock(_deviceLock);
+    if (_checkLost()) {
+        return false;
+    }
+    InterlockedExchange64(&_stats.startLate, 0);
+    return _arm() && _release();
+}
+
+bool Detail::arm()
+{
+    if (!_isOpen()) {
+        return false;
+    }
+    ScopedLock lock(_deviceLock);
+    if (_checkLost()) {
+        return false;
+    }
+    return _arm();
+}
+
+bool Detail::release(LONGLONG due)
+{
+    if (!_isOpen()) {
+        return false;
+    }
+    ScopedLock lock(_deviceLock);
+    if (_checkLost()) {
+        return false;
+    }
+    const LONGLONG late = qpcNow() - due;
+    InterlockedExchange64(&_stats.startLate, late > 0 ? late : 0);
+    return _release();
+}
+
+bool Detail::_arm()
+{
+    if (atomicLoad(_running)) {
+        return true;
+    }
+    // a preroll renders the start of the fade in
+    atomicStore(_fadeTarget, 1);
+    // a device being recovered is prerolled by the service thread
+    if (_recovering) {
+        return true;
+    }
+    // fill the ring with real audio so the first period is heard one period
+    // after this returns rather than after a ring of silence
+    if (!_primed && _info.preroll && !_preroll()) {
+        return false;
+    }
+    return true;
+}
+
+bool Detail::_release()
+{
+    PW_TRACE_ZONE("picowave release");
+    atomicStore(_fadeTarget, 1);
+    if (atomicLoad(_running)) {
+        // resuming from a faded pause, the device never stopped
+        return true;
+    }
+    if (_recovering) {
+        // the replacement device is started once it is ready
+        atomicStore(_running, 1);
+        return true;
+    }
+    if (_hwo) {
+        // carry on from the exact sample the device paused on
+        if (!MMOK(waveOutRestart(_hwo))) {
+            _error = PW_WAVEOUTWRITE_ERROR;
+            return false;
+        }
+    }
+    if (_audioClient) {
+        if (FAILED(_audioClient->Start())) {
+            _error = PW_WASAPI_START_ERROR;
+            return false;
+        }
+    }
+    if (_info.backend == PW_BACKEND_NULL_CLOCKED) {
+        // rebase the clock so time spent paused is not owed as periods
+        const LONGLONG periodTicks = (_qpcFreq * _info.periodSize) / _info.sampleRate;
+        InterlockedExchange64(&_clockStart, qpcNow() - _clockPeriods * periodTicks);
+        // poll twice per period so late wakes are caught up quickly
+        const DWORD periodMs = (1000 * _info.periodSize) / _info.sampleRate;
+        const LONG pollMs = (periodMs >= 2) ? LONG(periodMs / 2) : 1;
+        LARGE_INTEGER due;
+        due.QuadPart = -1;
+        if (!SetWaitableTimer(_waveEvent, &due, pollMs, NULL, NULL, FALSE)) {
+            _error = PW_CREATEEVENT_ERROR;
+            return false;
+        }
+    }
+    atomicStore(_running, 1);
+    _kick();
+    return true;
+}
+
+bool Detail::pause()
+{
+    if (!_isOpen()) {
+        return false;
+    }
+    ScopedLock lock(_deviceLock);
+    if (_checkLost()) {
+        return false;
+    }
+    if (_info.fadeFrames) {
+        // ramp down and let the device run on silence so start() can ramp
+        // straight back up
+        atomicStore(_fadeTarget, 0);
+        return true;
+    }
+    atomicStore(_running, 0);
+    if (_recovering) {
+        // the replacement device is left paused
+        return true;
+    }
+    if (_hwo) {
+        // the device keeps its queued headers and stops mid buffer
+        waveOutPause(_hwo);
+    }
+    if (_audioClient) {
+        // stopping the stream stops the events so the thread parks itself
+        _audioClient->Stop();
+    }
+    if (_info.backend == PW_BACKEND_NULL_CLOCKED) {
+        CancelWaitableTimer(_waveEvent);
+    }
+    return true;
+}
+
+size_t Detail::write(const void* data, size_t size)
+{
+    if (!_pushRing.valid()) {
+        return 0;
+    }
+    // never split a frame across writes
+    const size_t count = size < _pushRing.space() ? size : _pushRing.space();
+    return _pushRing.write(data, count - (count % _sourceBlockAlign()));
+}
+
+size_t Detail::available() const
+{
+    if (!_pushRing.valid()) {
+        return 0;
+    }
+    const size_t count = _pushRing.space();
+    return count - (count % _sourceBlockAlign());
+}
+
+void* Detail::acquire(size_t& size, uint32_t timeoutMs)
+{
+    size = 0;
+    if (!_isDirect() || !_isOpen() || _acquired) {
+        return NULL;
+    }
+    if (_hwo) {
+        // the device returns headers in order so only the head can be free
+        WAVEHDR& hdr = _wavehdr[_head];
+        if (!_headerFree(hdr)) {
+            WaitForSingleObject(_waveEvent, timeoutMs);
+            if (!_headerFree(hdr)) {
+                return NULL;
+            }
+        }
+        _acquired = true;
+        size = hdr.dwBufferLength;
+        return hdr.lpData;
+    }
+    assert(_audioClient && _renderClient);
+    UINT32 padding = 0;
+    if (FAILED(_audioClient->GetCurrentPadding(&padding))) {
+        return NULL;
+    }
+    if (_bufferFrames - padding < _periodFrames) {
+        WaitForSingleObject(_waveEvent, timeoutMs);
+        if (FAILED(_audioClient->GetCurrentPadding(&padding)) ||
+            _bufferFrames - padding < _periodFrames) {
+            return NULL;
+        }
+    }
+    BYTE* data = NULL;
+    if (FAILED(_renderClient->GetBuffer(_periodFrames, &data))) {
+        _error = PW_WASAPI_BUFFER_ERROR;
+        return NULL;
+    }
+    _acquired = true;
+    size = _periodFrames * _blockAlign();
+    return data;
+}
+
+bool Detail::commit()
+{
+    if (!_acquired) {
+        return false;
+    }
+    _acquired = false;
+    if (_hwo) {
+        WAVEHDR& hdr = _wavehdr[_head];
+        if (!_writeHeader(hdr)) {
+            _error = PW_WAVEOUTWRITE_ERROR;
+            return false;
+        }
+        _countSubmit(_info.periodSize);
+        _head = (_head + 1) % _wavehdr.size();
+    } else {
+        if (FAILED(_renderClient->ReleaseBuffer(_periodFrames, 0))) {
+            _error = PW_WASAPI_BUFFER_ERROR;
+            return false;
+        }
+        _countSubmit(_periodFrames);
+    }
+    return true;
+}
+
+bool Detail::_post(const Command& cmd)
+{
+    // direct mode renders on the caller's thread, there is nothing to drain
+    if (!_isOpen() || _isDirect()) {
+        return false;
+    }
+    if (!_controls.commands.post(cmd)) {
+        _error = PW_QUEUE_FULL;
+        return false;
+    }
+    return true;
+}
+
+bool Detail::setGain(float gain, uint32_t rampFrames)
+{
+    // the gain is applied to float32 ahead of conversion
+    if (_info.callbackFormat != PW_CALLBACK_FLOAT32 || !(gain >= 0.f && gain <= 16.f)) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_GAIN;
+    cmd.gain = gain;
+    cmd.rampFrames = rampFrames;
+    return _post(cmd);
+}
+
+bool Detail::setCallback(WaveProc callback, void* callbackData)
+{
+    // push mode never calls back
+    if (_info.callback == nullptr || callback == nullptr) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_CALLBACK;
+    cmd.callback = callback;
+    cmd.callbackData = callbackData;
+    return _post(cmd);
+}
+
+WaveStats Detail::stats() const
+{
+    WaveStats out;
+    out.buffersSubmitted = uint64_t(atomicLoad64(_stats.submitted));
+    out.underruns = uint64_t(atomicLoad64(_stats.underruns));
+    out.outOfOrder = uint64_t(atomicLoad64(_stats.outOfOrder));
+    out.recoveries = uint64_t(atomicLoad64(_stats.recoveries));
+    out.queueDepth = atomicLoad(_depth);
+    out.deadlineMisses = uint64_t(atomicLoad64(_stats.misses));
+    for (uint32_t i = 0; i < PW_HISTOGRAM_BUCKETS; ++i) {
+        out.renderHistogram[i] = uint64_t(atomicLoad64(_stats.histogram[i]));
+    }
+    out.startLateUs = 1000000.0 * double(atomicLoad64(_stats.startLate)) / double(_qpcFreq);
+    out.callbackSwaps = uint64_t(atomicLoad64(_stats.swaps));
+    _stats.callback.read(_qpcFreq, out.callbackMinUs, out.callbackAvgUs, out.callbackMaxUs);
+    _stats.submit.read(_qpcFreq, out.submitMinUs, out.submitAvgUs, out.submitMaxUs);
+    return out;
+}
+
+bool Detail::position(WavePosition& out) const
+{
+    if (!_isOpen()) {
+        return false;
+    }
+    ScopedLock lock(_deviceLock);
+    if (_recovering || _lost || !_readPosition(out)) {
+        return false;
+    }
+    _lastPlayed = out.framesPlayed;
+    return true;
+}
+
+bool Detail::_readPosition(WavePosition& out) const
+{
+    const uint64_t submitted = uint64_t(atomicLoad64(_framesSubmitted));
+    out.framesSubmitted = submitted;
+    // the device clock restarts at zero after a recovery
+    const uint64_t local = submitted - _submittedBase;
+    if (_hwo) {
+        MMTIME mmt;
+        mmt.wType = TIME_SAMPLES;
+        const LONGLONG before = qpcNow();
+        if (!MMOK(waveOutGetPosition(_hwo, &mmt, sizeof(mmt)))) {
+            return false;
+        }
+        const LONGLONG after = qpcNow();
+        // the device counter is only 32 bits, but it can never be more than
+        // 2^32 behind what we submitted so extend it from that
+        if (mmt.wType == TIME_SAMPLES) {
+            out.framesPlayed = local - uint32_t(uint32_t(local) - mmt.u.sample);
+        } else if (mmt.wType == TIME_BYTES) {
+            const uint64_t bytes = local * _blockAlign();
+            out.framesPlayed = (bytes - uint32_t(uint32_t(bytes) - mmt.u.cb)) / _blockAlign();
+        } else {
+            return false;
+        }
+        out.framesPlayed += _playedBase;
+        out.qpcTime = before + (after - before) / 2;
+        return true;
+    }
+    if (_audioClock) {
+        UINT64 pos = 0, qpcPos = 0;
+        if (FAILED(_audioClock->GetPosition(&pos, &qpcPos))) {
+            return false;
+        }
+        out.framesPlayed = _playedBase + (pos * _info.sampleRate) / _audioClockFreq;
+        // the stream clock reports qpc time in 100ns units, split the scale so
+        // it can't overflow on a machine with a long uptime
+        const UINT64 units = 10000000;
+        const UINT64 freq = UINT64(_qpcFreq);
+        out.qpcTime = int64_t((qpcPos / units) * freq + ((qpcPos % units) * freq) / units);
+        return true;
+    }
+    // a device that could not be recovered has no clock left
+    if (!_isNull()) {
+        return false;
+    }
+    // the null backends play exactly what their clock says they have consumed
+    out.qpcTime = qpcNow();
+    out.framesPlayed = submitted;
+    if (_info.backend == PW_BACKEND_NULL_CLOCKED) {
+        const LONGLONG elapsed = out.qpcTime - atomicLoad64(_clockStart);
+        const uint64_t played = uint64_t(elapsed > 0 ? elapsed : 0) * _info.sampleRate / _qpcFreq;
+        out.framesPlayed = played < submitted ? played : submitted;
+    }
+    return true;
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveOut Facade
+
+WaveOut::WaveOut()
+    : _detail(new Detail)
+{
+    assert(_detail);
+}
+
+WaveOut::~WaveOut()
+{
+    assert(_detail);
+    delete _detail;
+}
+
+bool WaveOut::open(const WaveInfo& info)
+{
+    assert(_detail);
+    return _detail->open(info);
+}
+
+bool WaveOut::start()
+{
+    assert(_detail);
+    return _detail->start();
+}
+
+bool WaveOut::startAt(int64_t qpcTime)
+{
+    WaveOut* self = this;
+    return startOutputs(&self, 1, qpcTime, NULL);
+}
+
+bool WaveOut::pause()
+{
+    assert(_detail);
+    return _detail->pause();
+}
+
+bool WaveOut::close()
+{
+    assert(_detail);
+    return _detail->close();
+}
+
+size_t WaveOut::write(const void* data, size_t size)
+{
+    assert(_detail);
+    return _detail->write(data, size);
+}
+
+size_t WaveOut::available() const
+{
+    assert(_detail);
+    return _detail->available();
+}
+
+WaveStats WaveOut::stats() const
+{
+    assert(_detail);
+    return _detail->stats();
+}
+
+bool WaveOut::position(WavePosition& out) const
+{
+    assert(_detail);
+    return _detail->position(out);
+}
+
+void* WaveOut::acquire(size_t& size, uint32_t timeoutMs)
+{
+    assert(_detail);
+    return _detail->acquire(size, timeoutMs);
+}
+
+bool WaveOut::commit()
+{
+    assert(_detail);
+    return _detail->commit();
+}
+
+bool WaveOut::setGain(float gain, uint32_t rampFrames)
+{
+    assert(_detail);
+    return _detail->setGain(gain, rampFrames);
+}
+
+bool WaveOut::setCallback(WaveProc callback, void* callbackData)
+{
+    assert(_detail);
+    return _detail->setCallback(callback, callbackData);
+}
+
+uint32_t WaveOut::lastError() const
+{
+    assert(_detail);
+    return _detail->lastError();
+}
+
+bool startOutputs(WaveOut* const* outputs, uint32_t count, int64_t qpcTime, double* skewUs)
+{
+    if (outputs == nullptr || count == 0) {
+        return false;
+    }
+    // preroll every ring first so the releases below are back to back
+    for (uint32_t i = 0; i < count; ++i) {
+        if (outputs[i] == nullptr || !outputs[i]->_detail->arm()) {
+            return false;
+        }
+    }
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    const LONGLONG due = qpcTime ? LONGLONG(qpcTime) : qpcNow();
+    // at the default 15.6 ms timer resolution Sleep(1) can overshoot by a
+    // whole tick, so raise it to 1 ms for the wait. Sleep(1) then returns
+    // within two ticks and the last 4 ms are spun out at a priority the
+    // scheduler will not preempt for normal work. if the resolution can not
+    // be raised the spin covers a full default tick instead
+    HANDLE thread = GetCurrentThread();
+    const int priority = GetThreadPriority(thread);
+    SetThreadPriority(thread, THREAD_PRIORITY_TIME_CRITICAL);
+    const bool fineTimer = timeBeginPeriod(1) == TIMERR_NOERROR;
+    const LONGLONG spinTicks = fineTimer ? freq.QuadPart / 250 : freq.QuadPart / 50;
+    while (due - qpcNow() > spinTicks) {
+        Sleep(1);
+    }
+    while (qpcNow() < due) {
+        YieldProcessor();
+    }
+    bool ok = true;
+    const LONGLONG first = qpcNow();
+    for (uint32_t i = 0; i < count; ++i) {
+        // keep going so one failed device does not hold the others back
+        ok = outputs[i]->_detail->release(due) && ok;
+    }
+    const LONGLONG last = qpcNow();
+    if (fineTimer) {
+        timeEndPeriod(1);
+    }
+    SetThreadPriority(thread, priority);
+    if (skewUs) {
+        *skewUs = 1000000.0 * double(last - first) / double(freq.QuadPart);
+    }
+    return ok;
+}
+
+bool describeWav(const char* path, WaveInfo& info)
+{
+    WavSource source;
+    if (path == nullptr || !source.open(path)) {
+        return false;
+    }
+    info.sampleRate = source.sampleRate;
+    info.bitDepth = source.bitDepth;
+    info.channels = source.channels;
+    info.sampleFormat = source.sampleFormat;
+    return true;
+}
+
+size_t ringMemorySize(const WaveInfo& info)
+{
+    WaveInfo resolved = info;
+    resolveRing(resolved);
+    return ringStride(resolved) * resolved.numBuffers;
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveIn Implementation
+
+bool InDetail::_validate(const WaveInfo& info)
+{
+    const uint32_t numBuffers = info.numBuffers ? info.numBuffers : defaultBuffers;
+    if (numBuffers < 2 || numBuffers > maxBuffers) {
+        return false;
+    }
+    if (info.periodSize == 0) {
+        if (!isPowerOfTwo(info.bufferSize) || info.bufferSize < numBuffers) {
+            return false;
+        }
+        if (info.bufferSize % numBuffers) {
+            return false;
+        }
+    }
+    if (info.callback == nullptr && info.pushSize == 0) {
+        return false;
+    }
+    if (info.sourcePath) {
+        return false;
+    }
+    if (info.pushSize > (1u << 24)) {
+        return false;
+    }
+    // captured audio is delivered as the device produced it
+    if (info.callbackFormat != PW_CALLBACK_PCM || !validFormat(info)) {
+        return false;
+    }
+    if (info.backend != PW_BACKEND_WAVEOUT && info.backend != PW_BACKEND_WASAPI_SHARED &&
+        info.backend != PW_BACKEND_WASAPI_EXCLUSIVE) {
+        return false;
+    }
+    // the output's thread services the capture, direct mode has none
+    if (info.duplex && !info.duplex->_detail->isServiced()) {
+        return false;
+    }
+    // a waveOut output thread never initializes com
+    if (info.duplex && info.backend != PW_BACKEND_WAVEOUT &&
+        !info.duplex->_detail->isComThread()) {
+        return false;
+    }
+    return true;
+}
+
+bool InDetail::open(const WaveInfo& info)
+{
+    if (_hwi || _audioClient || _waveThread || _waveEvent || _duplex) {
+        _error = PW_ALREADY_OPEN;
+        return false;
+    }
+    if (!_validate(info)) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    _info = info;
+    _stats.reset();
+    resolveRing(_info);
+    if (_info.pushSize) {
+        uint32_t capacity = 1;
+        while (capacity < _info.pushSize * _blockAlign()) {
+            capacity <<= 1;
+        }
+        _pushRing.init(capacity);
+    }
+    _waveEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (_waveEvent == NULL) {
+        _error = PW_CREATEEVENT_ERROR;
+        return false;
+    }
+    if (!(_isWasapi() ? _openWasapi() : _openWaveIn())) {
+        return false;
+    }
+    if (_info.duplex) {
+        // the output calls service() at the top of every wake from now on
+        if (!_info.duplex->_detail->attachCapture(this)) {
+            _error = PW_ALREADY_OPEN;
+            return false;
+        }
+        _duplex = _info.duplex->_detail;
+        return true;
+    }
+    _stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (_stopEvent == NULL) {
+        _error = PW_CREATEEVENT_ERROR;
+        return false;
+    }
+    _waveThread = CreateThread(NULL, 0, _threadProc, this, CREATE_SUSPENDED, 0);
+    if (_waveThread == NULL) {
+        _error = PW_CREATETHREAD_ERROR;
+        return false;
+    }
+    _error = configureThread(_waveThread, _info.priority, _info.affinity);
+    ResumeThread(_waveThread);
+    return _error == PW_OK;
+}
+
+bool InDetail::_openWaveIn()
+{
+    WAVEFORMATEXTENSIBLE waveformat;
+    makeWaveFormat(_info, waveformat);
+    const UINT deviceId = _info.device ? UINT(_info.device - 1) : WAVE_MAPPER;
+    if (!MMOK(waveInOpen(
+            &_hwi,
+            deviceId,
+            &waveformat.Format,
+            (DWORD_PTR)_waveEvent,
+            NULL,
+            CALLBACK_EVENT))) {
+        _hwi = NULL;
+        _error = PW_WAVEINOPEN_ERROR;
+        return false;
+    }
+    // the same ring layout as an output, every header starts out queued
+    const size_t alignment = ringAlign(_info);
+    const size_t hdrBytes = _info.periodSize * _blockAlign();
+    const size_t hdrStride = ringStride(_info);
+    uint8_t* ptr = (uint8_t*)_info.bufferMemory;
+    if (ptr == NULL) {
+        _rawAlloc = new uint8_t[hdrStride * _info.numBuffers + alignment];
+        ptr = (uint8_t*)alignPtr((uintptr_t)_rawAlloc, alignment);
+    }
+    _wavehdr.resize(_info.numBuffers);
+    _head = 0;
+    for (WAVEHDR& hdr : _wavehdr) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.lpData = (LPSTR)ptr;
+        hdr.dwBufferLength = DWORD(hdrBytes);
+        ptr += hdrStride;
+        if (!MMOK(waveInPrepareHeader(_hwi, &hdr, sizeof(hdr)))) {
+            _error = PW_WAVEINPREPHDR_ERROR;
+            return false;
+        }
+        if (!MMOK(waveInAddBuffer(_hwi, &hdr, sizeof(hdr)))) {
+            _error = PW_WAVEINADDBUFFER_ERROR;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool InDetail::_openWasapi()
+{
+    const HRESULT hrCom = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (SUCCEEDED(hrCom)) {
+        _comInit = true;
+    } else if (hrCom != RPC_E_CHANGED_MODE) {
+        _error = PW_COINITIALIZE_ERROR;
+        return false;
+    }
+    IMMDeviceEnumerator* enumerator = NULL;
+    if (FAILED(CoCreateInstance(
+            __uuidof(MMDeviceEnumerator),
+            NULL,
+            CLSCTX_ALL,
+            __uuidof(IMMDeviceEnumerator),
+            (void**)&enumerator))) {
+        _error = PW_WASAPI_DEVICE_ERROR;
+        return false;
+    }
+    const HRESULT hrDev = findEndpoint(enumerator, eCapture, _info.device, &_device);
+    safeRelease(enumerator);
+    if (FAILED(hrDev)) {
+        _error = PW_WASAPI_DEVICE_ERROR;
+        return false;
+    }
+    if (FAILED(_device->Activate(
+            __uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&_audioClient))) {
+        _error = PW_WASAPI_DEVICE_ERROR;
+        return false;
+    }
+    WAVEFORMATEXTENSIBLE waveformat;
+    makeWaveFormat(_info, waveformat);
+    HRESULT hr = S_OK;
+    if (_info.backend == PW_BACKEND_WASAPI_EXCLUSIVE) {
+        // the same period rules as render, packets are gathered into periods
+        // of our own size so the device period is free to differ
+        REFERENCE_TIME minPeriod = 0;
+        if (FAILED(_audioClient->GetDevicePeriod(NULL, &minPeriod))) {
+            _error = PW_WASAPI_INITIALIZE_ERROR;
+            return false;
+        }
+        REFERENCE_TIME period = framesToRefTime(_info.periodSize, _info.sampleRate);
+        if (period < minPeriod) {
+            period = minPeriod;
+        }
+        hr = _audioClient->Initialize(
+            AUDCLNT_SHAREMODE_EXCLUSIVE,
+            AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+            period,
+            period,
+            &waveformat.Format,
+            NULL);
+        if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED) {
+            UINT32 aligned = 0;
+            if (FAILED(_audioClient->GetBufferSize(&aligned))) {
+                _error = PW_WASAPI_INITIALIZE_ERROR;
+                return false;
+            }
+            safeRelease(_audioClient);
+            if (FAILED(_device->Activate(
+                    __uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&_audioClient))) {
+                _error = PW_WASAPI_DEVICE_ERROR;
+                return false;
+            }
+            period = framesToRefTime(aligned, _info.sampleRate);
+            hr = _audioClient->Initialize(
+                AUDCLNT_SHAREMODE_EXCLUSIVE,
+                AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+                period,
+                period,
+                &waveformat.Format,
+                NULL);
+        }
+    } else {
+        const DWORD flags = AUDCLNT_STREAMFLAGS_EVENTCALLBACK |
+                            AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM |
+                            AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY;
+        hr = _audioClient->Initialize(
+            AUDCLNT_SHAREMODE_SHARED,
+            flags,
+            framesToRefTime(_info.bufferSize, _info.sampleRate),
+            0,
+            &waveformat.Format,
+            NULL);
+    }
+    if (FAILED(hr)) {
+        _error = PW_WASAPI_INITIALIZE_ERROR;
+        return false;
+    }
+    if (FAILED(_audioClient->SetEventHandle(_waveEvent))) {
+        _error = PW_WASAPI_INITIALIZE_ERROR;
+        return false;
+    }
+    if (FAILED(_audioClient->GetService(
+            __uuidof(IAudioCaptureClient), (void**)&_captureClient))) {
+        _error = PW_WASAPI_INITIALIZE_ERROR;
+        return false;
+    }
+    // packets arrive in whatever size the engine likes, gather them here
+    _period = new uint8_t[_info.periodSize * _blockAlign()];
+    _periodFill = 0;
+    return true;
+}
+
+void InDetail::_emit(const void* buffer, size_t bufferSize)
+{
+    const LONGLONG begin = qpcNow();
+    if (_pushRing.valid()) {
+        // a full ring means the reader has fallen behind, drop the period
+        if (_pushRing.space() < bufferSize) {
+            InterlockedIncrement64(&_stats.underruns);
+        } else {
+            _pushRing.write(buffer, bufferSize);
+        }
+    } else if (_info.callback) {
+        _info.callback((void*)buffer, bufferSize, _info.callbackData);
+    }
+    _stats.callback.add(qpcNow() - begin);
+    InterlockedIncrement64(&_stats.submitted);
+}
+
+void InDetail::_deliver(const uint8_t* data, size_t size)
+{
+    const size_t periodBytes = _info.periodSize * _blockAlign();
+    while (size) {
+        const size_t space = periodBytes - _periodFill;
+        const size_t count = size < space ? size : space;
+        if (data) {
+            memcpy(_period + _periodFill, data, count);
+            data += count;
+        } else {
+            // the engine flagged the packet as silent
+            memset(_period + _periodFill, (_info.bitDepth == 8) ? 0x80 : 0, count);
+        }
+        _periodFill += count;
+        size -= count;
+        if (_periodFill == periodBytes) {
+            _emit(_period, periodBytes);
+            _periodFill = 0;
+        }
+    }
+}
+
+bool InDetail::service()
+{
+    if (!atomicLoad(_running)) {
+        return true;
+    }
+    if (!(_isWasapi() ? _serviceWasapi() : _serviceWaveIn())) {
+        // the device has gone, stop here rather than fail the duplex output
+        atomicStore(_running, 0);
+        _error = PW_DEVICE_LOST;
+        return false;
+    }
+    return true;
+}
+
+bool InDetail::_serviceWaveIn()
+{
+    assert(_hwi);
+    const size_t numBuffers = _wavehdr.size();
+    size_t numDone = 0;
+    while (_wavehdr[_head].dwFlags & WHDR_DONE) {
+        WAVEHDR& hdr = _wavehdr[_head];
+        _emit(hdr.lpData, hdr.dwBytesRecorded);
+        // hand it straight back so the device always has somewhere to write
+        if (!MMOK(waveInAddBuffer(_hwi, &hdr, sizeof(hdr)))) {
+            return false;
+        }
+        _head = (_head + 1) % numBuffers;
+        if (++numDone == numBuffers) {
+            break;
+        }
+    }
+    // every header full means the device had nowhere to write for a while
+    if (numDone == numBuffers) {
+        InterlockedIncrement64(&_stats.underruns);
+    }
+    return true;
+}
+
+bool InDetail::_serviceWasapi()
+{
+    assert(_captureClient);
+    UINT32 packet = 0;
+    if (FAILED(_captureClient->GetNextPacketSize(&packet))) {
+        return false;
+    }
+    while (packet) {
+        BYTE* data = NULL;
+        UINT32 frames = 0;
+        DWORD flags = 0;
+        if (FAILED(_captureClient->GetBuffer(&data, &frames, &flags, NULL, NULL))) {
+            return false;
+        }
+        if (flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY) {
+            InterlockedIncrement64(&_stats.underruns);
+        }
+        const bool silent = (flags & AUDCLNT_BUFFERFLAGS_SILENT) != 0;
+        _deliver(silent ? NULL : data, frames * _blockAlign());
+        if (FAILED(_captureClient->ReleaseBuffer(frames))) {
+            return false;
+        }
+        if (FAILED(_captureClient->GetNextPacketSize(&packet))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+DWORD WINAPI InDetail::_threadProc(LPVOID param)
+{
+    assert(param);
+    InDetail& self = *(InDetail*)param;
+    ThreadScope scope(self._isWasapi(), self._info.priority);
+    PW_TRACE_THREAD("picowave capture");
+    HANDLE events[2] = { self._stopEvent, self._waveEvent };
+    for (;;) {
+        const DWORD which = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+        if (which != WAIT_OBJECT_0 + 1) {
+            break;
+        }
+        if (!self.service()) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+bool InDetail::start()
+{
+    if (!_hwi && !_audioClient) {
+        return false;
+    }
+    if (_hwi && !MMOK(waveInStart(_hwi))) {
+        _error = PW_WAVEINSTART_ERROR;
+        return false;
+    }
+    if (_audioClient && FAILED(_audioClient->Start())) {
+        _error = PW_WASAPI_START_ERROR;
+        return false;
+    }
+    atomicStore(_running, 1);
+    return true;
+}
+
+bool InDetail::pause()
+{
+    if (!_hwi && !_audioClient) {
+        return false;
+    }
+    atomicStore(_running, 0);
+    if (_hwi) {
+        // a part filled header comes back done and is delivered on resume
+        waveInStop(_hwi);
+    }
+    if (_audioClient) {
+        _audioClient->Stop();
+    }
+    return true;
+}
+
+bool InDetail::close()
+{
+    atomicStore(_running, 0);
+    if (_duplex) {
+        // once this returns the output thread will not service us again
+        _duplex->attachCapture(NULL);
+        _duplex = NULL;
+    }
+    if (_waveThread) {
+        // waits out a running callback, see Detail::close()
+        SetEvent(_stopEvent);
+        WaitForSingleObject(_waveThread, INFINITE);
+        CloseHandle(_waveThread);
+        _waveThread = NULL;
+    }
+    _closeWaveIn();
+    _closeWasapi();
+    if (_stopEvent) {
+        CloseHandle(_stopEvent);
+        _stopEvent = NULL;
+    }
+    if (_waveEvent) {
+        CloseHandle(_waveEvent);
+        _waveEvent = NULL;
+    }
+    _wavehdr.clear();
+    _pushRing.release();
+    if (_rawAlloc) {
+        delete[] _rawAlloc;
+        _rawAlloc = NULL;
+    }
+    if (_period) {
+        delete[] _period;
+        _period = NULL;
+    }
+    _periodFill = 0;
+    memset(&_info, 0, sizeof(_info));
+    return true;
+}
+
+void InDetail::_closeWaveIn()
+{
+    if (_hwi) {
+        // return the queued headers so they can be unprepared
+        waveInReset(_hwi);
+        for (WAVEHDR& hdr : _wavehdr) {
+            if (hdr.dwFlags & WHDR_PREPARED) {
+                waveInUnprepareHeader(_hwi, &hdr, sizeof(hdr));
+            }
+        }
+        waveInClose(_hwi);
+        _hwi = NULL;
+    }
+}
+
+void InDetail::_closeWasapi()
+{
+    if (_audioClient) {
+        _audioClient->Stop();
+    }
+    safeRelease(_captureClient);
+    safeRelease(_audioClient);
+    safeRelease(_device);
+    if (_comInit) {
+        CoUninitialize();
+        _comInit = false;
+    }
+}
+
+size_t InDetail::read(void* data, size_t size)
+{
+    if (!_pushRing.valid()) {
+        return 0;
+    }
+    const size_t count = size < _pushRing.used() ? size : _pushRing.used();
+    return _pushRing.read(data, count - (count % _blockAlign()));
+}
+
+size_t InDetail::available() const
+{
+    if (!_pushRing.valid()) {
+        return 0;
+    }
+    const size_t count = _pushRing.used();
+    return count - (count % _blockAlign());
+}
+
+WaveStats InDetail::stats() const
+{
+    WaveStats out;
+    memset(&out, 0, sizeof(out));
+    out.buffersSubmitted = uint64_t(atomicLoad64(_stats.submitted));
+    out.underruns = uint64_t(atomicLoad64(_stats.underruns));
+    _stats.callback.read(_qpcFreq, out.callbackMinUs, out.callbackAvgUs, out.callbackMaxUs);
+    out.queueDepth = _info.numBuffers;
+    return out;
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveIn Facade
+
+WaveIn::WaveIn()
+    : _detail(new InDetail)
+{
+    assert(_detail);
+}
+
+WaveIn::~WaveIn()
+{
+    assert(_detail);
+    delete _detail;
+}
+
+bool WaveIn::open(const WaveInfo& info)
+{
+    assert(_detail);
+    return _detail->open(info);
+}
+
+bool WaveIn::start()
+{
+    assert(_detail);
+    return _detail->start();
+}
+
+bool WaveIn::pause()
+{
+    assert(_detail);
+    return _detail->pause();
+}
+
+bool WaveIn::close()
+{
+    assert(_detail);
+    return _detail->close();
+}
+
+size_t WaveIn::read(void* data, size_t size)
+{
+    assert(_detail);
+    return _detail->read(data, size);
+}
+
+size_t WaveIn::available() const
+{
+    assert(_detail);
+    return _detail->available();
+}
+
+WaveStats WaveIn::stats() const
+{
+    assert(_detail);
+    return _detail->stats();
+}
+
+uint32_t WaveIn::lastError() const
+{
+    assert(_detail);
+    return _detail->lastError();
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Device Enumeration
+
+namespace {
+// defined here rather than taken from functiondiscoverykeys_devpkey.h so no
+// extra guid library is needed
+const PROPERTYKEY friendlyNameKey = {
+    { 0xa45c254e, 0xdf1c, 0x4efd, { 0x80, 0x20, 0x67, 0xd1, 0x46, 0xa8, 0x50, 0xe0 } }, 14
+};
+const PROPERTYKEY deviceFormatKey = {
+    { 0xf19f064d, 0x082c, 0x4e27, { 0xbc, 0x73, 0x68, 0x82, 0xa1, 0xbb, 0x8e, 0x4c } }, 0
+};
+
+void clearDevice(WaveDevice& out, uint32_t id)
+{
+    memset(&out, 0, sizeof(out));
+    out.id = id;
+}
+
+// waveOut and waveIn caps share the name, channel and format fields
+template <typename caps_t>
+void describeCaps(const caps_t& caps, WaveDevice& dev)
+{
+    // best format flag first for each rate and depth
+    const struct {
+        DWORD flags;
+        uint32_t sampleRate;
+        uint32_t bitDepth;
+    } formats[] = {
+        { WAVE_FORMAT_96M16 | WAVE_FORMAT_96S16, 96000, 16 },
+        { WAVE_FORMAT_48M16 | WAVE_FORMAT_48S16, 48000, 16 },
+        { WAVE_FORMAT_4M16 | WAVE_FORMAT_4S16, 44100, 16 },
+        { WAVE_FORMAT_2M16 | WAVE_FORMAT_2S16, 22050, 16 },
+        { WAVE_FORMAT_1M16 | WAVE_FORMAT_1S16, 11025, 16 },
+        { WAVE_FORMAT_4M08 | WAVE_FORMAT_4S08, 44100, 8 },
+    };
+    strncpy(dev.name, caps.szPname, sizeof(dev.name) - 1);
+    dev.channels = caps.wChannels;
+    for (const auto& format : formats) {
+        if (caps.dwFormats & format.flags) {
+            dev.sampleRate = format.sampleRate;
+            dev.bitDepth = format.bitDepth;
+            break;
+        }
+    }
+}
+
+uint32_t enumerateWaveOut(WaveDevice* out, uint32_t maxDevices)
+{
+    const uint32_t numDevices = waveOutGetNumDevs();
+    for (uint32_t i = 0; i < numDevices && i < maxDevices; ++i) {
+        clearDevice(out[i], i + 1);
+        WAVEOUTCAPSA caps;
+        if (MMOK(waveOutGetDevCapsA(i, &caps, sizeof(caps)))) {
+            describeCaps(caps, out[i]);
+        }
+    }
+    return numDevices;
+}
+
+uint32_t enumerateWaveIn(WaveDevice* out, uint32_t maxDevices)
+{
+    const uint32_t numDevices = waveInGetNumDevs();
+    for (uint32_t i = 0; i < numDevices && i < maxDevices; ++i) {
+        clearDevice(out[i], i + 1);
+        WAVEINCAPSA caps;
+        if (MMOK(waveInGetDevCapsA(i, &caps, sizeof(caps)))) {
+            describeCaps(caps, out[i]);
+        }
+    }
+    return numDevices;
+}
+
+void describeEndpoint(IMMDevice* device, bool exclusive, WaveDevice& out)
+{
+    IPropertyStore* props = NULL;
+    if (SUCCEEDED(device->OpenPropertyStore(STGM_READ, &props))) {
+        PROPVARIANT value;
+        PropVariantInit(&value);
+        if (SUCCEEDED(props->GetValue(friendlyNameKey, &value)) && value.vt == VT_LPWSTR) {
+            WideCharToMultiByte(
+                CP_UTF8, 0, value.pwszVal, -1, out.name, sizeof(out.name) - 1, NULL, NULL);
+        }
+        PropVariantClear(&value);
+        // exclusive streams open at the device format rather than the mix
+        if (exclusive && SUCCEEDED(props->GetValue(deviceFormatKey, &value)) &&
+            value.vt == VT_BLOB && value.blob.cbSize >= sizeof(WAVEFORMATEX)) {
+            const WAVEFORMATEX* fmt = (const WAVEFORMATEX*)value.blob.pBlobData;
+            out.sampleRate = fmt->nSamplesPerSec;
+            out.bitDepth = fmt->wBitsPerSample;
+            out.channels = fmt->nChannels;
+        }
+        PropVariantClear(&value);
+        safeRelease(props);
+    }
+    if (out.sampleRate) {
+        return;
+    }
+    // shared streams are mixed at the engine format
+    IAudioClient* client = NULL;
+    if (SUCCEEDED(device->Activate(__uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&client))) {
+        WAVEFORMATEX* fmt = NULL;
+        if (SUCCEEDED(client->GetMixFormat(&fmt))) {
+            out.sampleRate = fmt->nSamplesPerSec;
+            out.bitDepth = fmt->wBitsPerSample;
+            out.channels = fmt->nChannels;
+            CoTaskMemFree(fmt);
+        }
+        safeRelease(client);
+    }
+}
+
+uint32_t enumerateWasapi(
+    EDataFlow flow, bool exclusive, WaveDevice* out, uint32_t maxDevices)
+{
+    const HRESULT hrCom = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (FAILED(hrCom) && hrCom != RPC_E_CHANGED_MODE) {
+        return 0;
+    }
+    UINT numDevices = 0;
+    IMMDeviceEnumerator* enumerator = NULL;
+    IMMDeviceCollection* devices = NULL;
+    if (SUCCEEDED(CoCreateInstance(
+            __uuidof(MMDeviceEnumerator),
+            NULL,
+            CLSCTX_ALL,
+            __uuidof(IMMDeviceEnumerator),
+            (void**)&enumerator)) &&
+        SUCCEEDED(enumerator->EnumAudioEndpoints(flow, DEVICE_STATE_ACTIVE, &devices)) &&
+        SUCCEEDED(devices->GetCount(&numDevices))) {
+        for (UINT i = 0; i < numDevices && i < maxDevices; ++i) {
+            clearDevice(out[i], i + 1);
+            IMMDevice* device = NULL;
+            if (SUCCEEDED(devices->Item(i, &device))) {
+                describeEndpoint(device, exclusive, out[i]);
+                safeRelease(device);
+            }
+        }
+    }
+    safeRelease(devices);
+    safeRelease(enumerator);
+    if (SUCCEEDED(hrCom)) {
+        CoUninitialize();
+    }
+    return numDevices;
+}
+}
+
+uint32_t enumerateDevices(uint32_t backend, WaveDevice* out, uint32_t maxDevices)
+{
+    if (out == nullptr) {
+        maxDevices = 0;
+    }
+    switch (backend) {
+    case PW_BACKEND_WAVEOUT:
+        return enumerateWaveOut(out, maxDevices);
+    case PW_BACKEND_WASAPI_SHARED:
+        return enumerateWasapi(eRender, false, out, maxDevices);
+    case PW_BACKEND_WASAPI_EXCLUSIVE:
+        return enumerateWasapi(eRender, true, out, maxDevices);
+    default:
+        // the null backends have no devices to choose from
+        return 0;
+    }
+}
+
+uint32_t enumerateCaptureDevices(uint32_t backend, WaveDevice* out, uint32_t maxDevices)
+{
+    if (out == nullptr) {
+        maxDevices = 0;
+    }
+    switch (backend) {
+    case PW_BACKEND_WAVEOUT:
+        return enumerateWaveIn(out, maxDevices);
+    case PW_BACKEND_WASAPI_SHARED:
+        return enumerateWasapi(eCapture, false, out, maxDevices);
+    case PW_BACKEND_WASAPI_EXCLUSIVE:
+        return enumerateWasapi(eCapture, true, out, maxDevices);
+    default:
+        return 0;
+    }
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveGroup Implementation
+
+bool GroupDetail::open(uint32_t priority, uint64_t affinity)
+{
+    if (_thread) {
+        _error = PW_ALREADY_OPEN;
+        return false;
+    }
+    if (priority > PW_PRIORITY_TIME_CRITICAL) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    _priority = priority;
+    _control = CreateEventA(NULL, FALSE, FALSE, NULL);
+    _applyEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (_control == NULL || _applyEvent == NULL) {
+        _error = PW_CREATEEVENT_ERROR;
+        close();
+        return false;
+    }
+    InterlockedExchange(&_alive, 1);
+    _thread = CreateThread(NULL, 0, _threadProc, this, CREATE_SUSPENDED, 0);
+    if (_thread == NULL) {
+        _error = PW_CREATETHREAD_ERROR;
+        close();
+        return false;
+    }
+    _error = configureThread(_thread, priority, affinity);
+    if (_error != PW_OK) {
+        const uint32_t error = _error;
+        close();
+        _error = error;
+        return false;
+    }
+    ResumeThread(_thread);
+    return true;
+}
+
+bool GroupDetail::close()
+{
+    EnterCriticalSection(&_lock);
+    const bool empty = _members.empty();
+    LeaveCriticalSection(&_lock);
+    if (!empty) {
+        _error = PW_GROUP_ERROR;
+        return false;
+    }
+    InterlockedExchange(&_alive, 0);
+    if (_thread) {
+        SetEvent(_control);
+        WaitForSingleObject(_thread, INFINITE);
+        CloseHandle(_thread);
+        _thread = NULL;
+    }
+    if (_control) {
+        CloseHandle(_control);
+        _control = NULL;
+    }
+    if (_applyEvent) {
+        CloseHandle(_applyEvent);
+        _applyEvent = NULL;
+    }
+    return true;
+}
+
+bool GroupDetail::add(Detail* member)
+{
+    assert(member);
+    if (!_thread) {
+        return false;
+    }
+    EnterCriticalSection(&_lock);
+    if (_members.size() >= maxMembers) {
+        LeaveCriticalSection(&_lock);
+        return false;
+    }
+    _members.push_back(member);
+    const uint32_t generation = uint32_t(InterlockedIncrement(&_generation));
+    LeaveCriticalSection(&_lock);
+    _waitForApply(generation);
+    return true;
+}
+
+void GroupDetail::remove(Detail* member)
+{
+    EnterCriticalSection(&_lock);
+    for (size_t i = 0; i < _members.size(); ++i) {
+        if (_members[i] == member) {
+            _members.erase(_members.begin() + i);
+            break;
+        }
+    }
+    const uint32_t generation = uint32_t(InterlockedIncrement(&_generation));
+    LeaveCriticalSection(&_lock);
+    _waitForApply(generation);
+}
+
+GroupDetail::~GroupDetail()
+{
+    // members keep a pointer to the group, it must outlive all of them
+    assert(_members.empty());
+    // a release build detaches any left behind so none is serviced by a
+    // thread that is gone or holds a dangling pointer, they then fail as
+    // closed until close() is called on them
+    EnterCriticalSection(&_lock);
+    const std::vector<Detail*> members = _members;
+    LeaveCriticalSection(&_lock);
+    for (Detail* member : members) {
+        remove(member);
+        ScopedLock lock(member->_deviceLock);
+        member->_group = NULL;
+    }
+    close();
+    DeleteCriticalSection(&_lock);
+}
 
-#include <Windows.h>
+void GroupDetail::_waitForApply(uint32_t generation)
+{
+    // the thread may be inside a member callback so give it until that
+    // period is done to pick the change up
+    SetEvent(_control);
+    while (int32_t(atomicLoad(_applied) - generation) < 0) {
+        // a thread that has given up will never apply it
+        if (WaitForSingleObject(_thread, 0) == WAIT_OBJECT_0) {
+            break;
+        }
+        WaitForSingleObject(_applyEvent, 1);
+    }
+}
 
-#include "picowave.h"
+DWORD WINAPI GroupDetail::_threadProc(LPVOID param)
+{
+    assert(param);
+    GroupDetail& self = *(GroupDetail*)param;
+    // members may be any backend so always join the mta
+    ThreadScope scope(true, self._priority);
+    PW_TRACE_THREAD("picowave group");
+    // local copy of the wait set, slot 0 is always the control event
+    std::vector<Detail*> members;
+    std::vector<HANDLE> handles;
+    members.reserve(maxMembers);
+    handles.reserve(maxMembers + 1);
+    while (self._alive) {
+        // pick up membership changes
+        const uint32_t generation = atomicLoad(self._generation);
+        if (generation != atomicLoad(self._applied)) {
+            EnterCriticalSection(&self._lock);
+            members = self._members;
+            LeaveCriticalSection(&self._lock);
+            handles.assign(1, self._control);
+            for (Detail* member : members) {
+                handles.push_back(member->_waveEvent);
+            }
+            atomicStore(self._applied, generation);
+            SetEvent(self._applyEvent);
+        }
+        const DWORD ret = WaitForMultipleObjects(
+            DWORD(handles.size()), handles.data(), FALSE, INFINITE);
+        if (ret == WAIT_FAILED) {
+            // a bad handle fails every wait from here on, fail the members
+            // rather than spin
+            for (Detail* member : members) {
+                atomicStore(member->_failed, 1);
+            }
+            self._error = PW_GROUP_ERROR;
+            break;
+        }
+        const DWORD index = ret - WAIT_OBJECT_0;
+        if (index == 0 || index >= handles.size()) {
+            continue;
+        }
+        // a wait only reports the lowest signalled slot, so check every slot
+        // above it too or devices near the front could starve the rest
+        for (size_t i = index; i < handles.size(); ++i) {
+            if (i != index && WaitForSingleObject(handles[i], 0) != WAIT_OBJECT_0) {
+                continue;
+            }
+            Detail& member = *members[i - 1];
+            if (!atomicLoad(member._running) || atomicLoad(member._failed)) {
+                continue;
+            }
+            if (!member._wake()) {
+                // stop servicing a device that has failed, the others keep going
+                atomicStore(member._failed, 1);
+            }
+        }
+    }
+    return 0;
+}
 
-#define MMOK(EXP) ((EXP) == MMSYSERR_NOERROR)
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveGroup Facade
 
-namespace PicoWave {
+WaveGroup::WaveGroup()
+    : _detail(new GroupDetail)
+{
+    assert(_detail);
+}
 
-// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveOut Implementation
+WaveGroup::~WaveGroup()
+{
+    assert(_detail);
+    delete _detail;
+}
 
-struct Detail {
+bool WaveGroup::open(uint32_t priority, uint64_t affinity)
+{
+    assert(_detail);
+    return _detail->open(priority, affinity);
+}
 
-    Detail()
-        : _hwo(NULL)
-        , _alive(0)
-        , _waveEvent(NULL)
-        , _waveThread(NULL)
-        , _rawAlloc(NULL)
-        , _error(PW_OK)
+bool WaveGroup::close()
+{
+    assert(_detail);
+    return _detail->close();
+}
+
+uint32_t WaveGroup::lastError() const
+{
+    assert(_detail);
+    return _detail->lastError();
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Mixer Implementation
+
+namespace {
+enum {
+    voiceFree,       // slot may be claimed by addVoice/addStream
+    voiceClaimed,    // slot is being filled in by a control thread
+    voiceActive,     // slot is mixed each period
+    voiceRetired,    // slot is skipped and waiting to be released
+    voiceReleasing,  // retired from a voice callback, freed after the period
+};
+
+// floats are passed to the wave thread through their bit pattern
+LONG floatBits(float in)
+{
+    LONG out;
+    memcpy(&out, &in, sizeof(out));
+    return out;
+}
+
+float bitsFloat(LONG in)
+{
+    float out;
+    memcpy(&out, &in, sizeof(out));
+    return out;
+}
+}
+
+struct Voice {
+
+    Voice()
+        : state(voiceFree)
+        , gain(0)
+        , writers(0)
+        , proc(NULL)
+        , user(NULL)
     {
-        memset(&_wavehdr, 0, sizeof(_wavehdr));
-        memset(&_info, 0, sizeof(_info));
     }
 
-    ~Detail()
+    LONG volatile state;
+    LONG volatile gain;
+    // threads inside writeStream(), the ring is only freed once this is zero
+    LONG volatile writers;
+    VoiceProc proc;
+    void* user;
+    // frames queued by writeStream() when the voice has no callback
+    PushRing ring;
+};
+
+struct MixerDetail {
+
+    MixerDetail()
+        : _voices(NULL)
+        , _maxVoices(0)
+        , _epoch(0)
+        , _mixThread(0)
+        , _channels(0)
+        , _scratchFrames(0)
+        , _scratchAlloc(NULL)
+        , _scratch(NULL)
+        , _mixAdd(NULL)
+    {
+    }
+
+    ~MixerDetail()
     {
         close();
     }
 
-    bool open(const WaveInfo& info);
+    bool open(const WaveInfo& info, uint32_t maxVoices);
 
-    bool start();
+    bool close();
 
-    bool pause();
+    int32_t addVoice(VoiceProc proc, void* user, float gain, uint32_t ringFrames);
 
-    bool close();
+    size_t writeStream(int32_t voice, const float* data, size_t numFrames);
 
-    uint32_t lastError() const
-    {
-        return _error;
-    }
+    bool setGain(int32_t voice, float gain);
 
-protected:
-    bool _prepare();
-    bool _validate(const WaveInfo& info);
+    bool removeVoice(int32_t voice);
 
-    static DWORD WINAPI _threadProc(LPVOID param);
+    WaveOut _output;
 
-    // internal wave info
-    std::array<WAVEHDR, 4> _wavehdr;
-    HWAVEOUT _hwo;
-    LONG volatile _alive;
-    HANDLE _waveEvent;
-    HANDLE _waveThread;
-    // allocation used for all buffers
-    uint8_t* _rawAlloc;
-    // user supplied info
-    WaveInfo _info;
-    // error code
-    uint32_t _error;
-};
+protected:
+    static void _mixProc(void* buffer, size_t bufferSize, void* user);
+    void _mix(float* out, size_t numFrames);
+    void _renderVoice(Voice& voice, float* out, size_t numFrames);
+    Voice* _voice(int32_t voice) const;
+    static void _waitWriters(Voice& voice);
 
-namespace {
-uintptr_t alignPtr(uintptr_t ptr, const uintptr_t align)
-{
-    const uintptr_t offset = align - 1;
-    const uintptr_t mask = ~(align - 1);
-    return (ptr + offset) & mask;
-}
+    Voice* _voices;
+    uint32_t _maxVoices;
+    // bumped on entry and exit of every period, odd while the wave thread is
+    // mixing, so control threads can tell when a retired voice is unused
+    LONG volatile _epoch;
+    // id of the thread mixing the current period, removeVoice() from there
+    // must not wait for the period to end
+    LONG volatile _mixThread;
+    uint32_t _channels;
+    // aligned per voice render target sized to one period
+    size_t _scratchFrames;
+    uint8_t* _scratchAlloc;
+    float* _scratch;
+    MixAddProc _mixAdd;
+};
 
-bool isPowerOfTwo(size_t in)
+void MixerDetail::_mixProc(void* buffer, size_t bufferSize, void* user)
 {
-    return 0 == (in & (in - 1));
-}
+    assert(user);
+    MixerDetail& self = *(MixerDetail*)user;
+    const size_t numFrames = bufferSize / (sizeof(float) * self._channels);
+    self._mix((float*)buffer, numFrames);
 }
 
-bool Detail::_prepare()
+void MixerDetail::_mix(float* out, size_t numFrames)
 {
-    assert(_hwo);
-    // 128 bits of alignment
-    const size_t alignment = 16;
-    // full number of samples required
-    const size_t numSamples = _info.bufferSize * _info.channels;
-    // full buffer amount requested in bytes
-    const size_t numBytes = numSamples * _info.bitDepth / 8;
-    // allocate with room for alignment
-    _rawAlloc = new uint8_t[numBytes + alignment];
-    // align the allocation
-    uint8_t* ptr = (uint8_t*)alignPtr((uintptr_t)_rawAlloc, alignment);
-    memset(ptr, 0, numBytes);
-    // number of samples for each waveheader
-    const size_t hdrSamples = numBytes / _wavehdr.size();
-
-    for (WAVEHDR& hdr : _wavehdr) {
-        // check alignment holds
-        assert(0 == ((uintptr_t)ptr & (alignment - 1)));
-        // allocate the wave header object
-        memset(&hdr, 0, sizeof(hdr));
-        hdr.lpData = (LPSTR)ptr;
-        hdr.dwBufferLength = hdrSamples;
-        // prepare the header for the device
-        if (!MMOK(waveOutPrepareHeader(_hwo, &hdr, sizeof(hdr)))) {
-            _error = PW_WAVEOUTPREPHDR_ERROR;
-            return false;
+    atomicStore(_mixThread, uint32_t(GetCurrentThreadId()));
+    InterlockedIncrement(&_epoch);
+    memset(out, 0, numFrames * _channels * sizeof(float));
+    // each voice renders a whole period at a time, only splitting if the
+    // device handed us more than a period
+    for (size_t offset = 0; offset < numFrames; offset += _scratchFrames) {
+        const size_t count = (numFrames - offset) < _scratchFrames
+                               ? (numFrames - offset)
+                               : _scratchFrames;
+        float* dst = out + offset * _channels;
+        for (uint32_t i = 0; i < _maxVoices; ++i) {
+            Voice& voice = _voices[i];
+            if (atomicLoad(voice.state) != voiceActive) {
+                continue;
+            }
+            _renderVoice(voice, _scratch, count);
+            _mixAdd(dst, _scratch, count * _channels, bitsFloat(voice.gain));
         }
-        // write the buffer to the device
-        if (!MMOK(waveOutWrite(_hwo, &hdr, sizeof(hdr)))) {
-            _error = PW_WAVEOUTWRITE_ERROR;
-            return false;
+    }
+    // voices removed from their own callback are done with now. their rings
+    // may still have a writer inside so they are freed on reuse or close()
+    for (uint32_t i = 0; i < _maxVoices; ++i) {
+        Voice& voice = _voices[i];
+        if (atomicLoad(voice.state) == voiceReleasing) {
+            voice.proc = NULL;
+            voice.user = NULL;
+            atomicStore(voice.state, voiceFree);
         }
-        // next chunk of samples for the next waveheader
-        ptr += hdrSamples;
     }
-    return true;
+    InterlockedIncrement(&_epoch);
 }
 
-DWORD WINAPI Detail::_threadProc(LPVOID param)
+void MixerDetail::_renderVoice(Voice& voice, float* out, size_t numFrames)
 {
-    assert(param);
-    Detail& self = *(Detail*)param;
-    assert(self._hwo);
-    // loop while this thread is alive
-    while (self._alive) {
-        // wait for a wave event
-        const DWORD ret = WaitForSingleObject(self._waveEvent, INFINITE);
-        // poll waveheaders for a free block
-        for (WAVEHDR& hdr : self._wavehdr) {
-            if ((hdr.dwFlags & WHDR_DONE) == 0) {
-                // buffer is not free for use
-                continue;
-            }
-            if (!MMOK(waveOutUnprepareHeader(self._hwo, &hdr, sizeof(hdr)))) {
-                return 1;
-            }
-            // call user function to fill with new self
-            WaveProc callback = self._info.callback;
-            if (callback) {
-                void* cbData = self._info.callbackData;
-                callback(hdr.lpData, hdr.dwBufferLength, cbData);
-            }
-            if (!MMOK(waveOutPrepareHeader(self._hwo, &hdr, sizeof(hdr)))) {
-                return 1;
-            }
-            if (!MMOK(waveOutWrite(self._hwo, &hdr, sizeof(WAVEHDR)))) {
-                return 1;
-            }
-        }
+    const size_t numBytes = numFrames * _channels * sizeof(float);
+    if (voice.proc) {
+        voice.proc(out, numFrames, voice.user);
+        return;
+    }
+    // stream voices pad any shortfall with silence
+    const size_t got = voice.ring.read(out, numBytes);
+    if (got < numBytes) {
+        memset((uint8_t*)out + got, 0, numBytes - got);
     }
-    return 0;
 }
 
-bool Detail::_validate(const WaveInfo& info)
+Voice* MixerDetail::_voice(int32_t voice) const
 {
-    if (!isPowerOfTwo(info.bufferSize)) {
-        return false;
+    if (voice < 0 || uint32_t(voice) >= _maxVoices) {
+        return NULL;
     }
-    if (info.callback == nullptr) {
-        return false;
+    return &_voices[voice];
+}
+
+// writers check the state after announcing themselves, so once a voice has
+// left voiceActive this only waits out writes already under way
+void MixerDetail::_waitWriters(Voice& voice)
+{
+    while (atomicLoad(voice.writers) != 0) {
+        Sleep(0);
     }
-    if (info.bitDepth != 16 || info.bitDepth != 8) {
+}
+
+bool MixerDetail::open(const WaveInfo& info, uint32_t maxVoices)
+{
+    if (_voices || maxVoices == 0) {
         return false;
     }
-    switch (info.sampleRate) {
-    case 44100:
-    case 22050:
-    case 11025:
-        break;
-    default:
+    _channels = info.channels;
+    // match the period size the output will resolve to
+    const uint32_t numBuffers = info.numBuffers ? info.numBuffers : defaultBuffers;
+    _scratchFrames = info.periodSize ? info.periodSize : info.bufferSize / numBuffers;
+    if (_channels == 0 || _scratchFrames == 0) {
         return false;
     }
-    if (info.channels != 1 && info.channels != 2) {
+    // 256 bits of alignment for the voice callbacks and mix kernels
+    const size_t alignment = 32;
+    const size_t numBytes = _scratchFrames * _channels * sizeof(float);
+    _scratchAlloc = new uint8_t[numBytes + alignment];
+    _scratch = (float*)alignPtr((uintptr_t)_scratchAlloc, alignment);
+    _mixAdd = selectMixAdd();
+    _voices = new Voice[maxVoices];
+    _maxVoices = maxVoices;
+    // the mixer is the float32 callback for the output
+    WaveInfo out = info;
+    out.callback = _mixProc;
+    out.callbackData = this;
+    out.callbackFormat = PW_CALLBACK_FLOAT32;
+    out.pushSize = 0;
+    if (!_output.open(out)) {
+        close();
         return false;
     }
     return true;
 }
 
-bool Detail::open(const WaveInfo& info)
+bool MixerDetail::close()
 {
-    // check if already running
-    if (_hwo || _waveThread || _waveEvent) {
-        _error = PW_ALREADY_OPEN;
-        return false;
-    }
-    if (_validate(info)) {
-        _error = PW_WAVEINFO_ERROR;
-        return false;
-    }
-    // mark callback thread as alive
-    InterlockedExchange(&_alive, 1);
-    // copy wave info structure to internal data for reference
-    _info = info;
-    // create waitable wave event
-    _waveEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
-    if (_waveEvent == NULL) {
-        _error = PW_CREATEEVENT_ERROR;
-        return false;
-    }
-    // prepare output wave format
-    WAVEFORMATEX waveformat;
-    memset(&waveformat, 0, sizeof(waveformat));
-    waveformat.cbSize = 0;
-    waveformat.wFormatTag = WAVE_FORMAT_PCM;
-    waveformat.nChannels = info.channels;
-    waveformat.nSamplesPerSec = info.sampleRate;
-    waveformat.wBitsPerSample = info.bitDepth;
-    waveformat.nBlockAlign = (info.channels * waveformat.wBitsPerSample) / 8;
-    waveformat.nAvgBytesPerSec = info.sampleRate * waveformat.nBlockAlign;
-    // create wave output
-    memset(&_hwo, 0, sizeof(_hwo));
-    if (!MMOK(waveOutOpen(
-            &_hwo,
-            WAVE_MAPPER,
-            &waveformat,
-            (DWORD_PTR)_waveEvent,
-            NULL,
-            CALLBACK_EVENT))) {
-        _error = PW_WAVEOUTOPEN_ERROR;
-        return false;
+    const bool ok = _output.close();
+    if (_voices) {
+        delete[] _voices;
+        _voices = NULL;
     }
-    // create the wave thread
-    _waveThread = CreateThread(
-        NULL, 0, _threadProc, this, CREATE_SUSPENDED, 0);
-    if (_waveThread == NULL) {
-        _error = PW_CREATETHREAD_ERROR;
-        return false;
+    _maxVoices = 0;
+    if (_scratchAlloc) {
+        delete[] _scratchAlloc;
+        _scratchAlloc = NULL;
+        _scratch = NULL;
     }
-    // prepare waveout for playback
-    return _prepare();
+    return ok;
 }
 
-bool Detail::close()
+int32_t MixerDetail::addVoice(VoiceProc proc, void* user, float gain, uint32_t ringFrames)
 {
-    InterlockedExchange(&_alive, 0);
-    if (_waveThread) {
-        bool hardKill = true;
-        const DWORD timeout = 1000;
-        if (WaitForSingleObject(_waveThread, timeout)) {
-            // thread join failed :'(
-        }
-        DWORD exitCode = 0;
-        if (GetExitCodeThread(_waveThread, &exitCode)) {
-            if (exitCode != STILL_ACTIVE) {
-                hardKill = false;
-            }
+    for (uint32_t i = 0; i < _maxVoices; ++i) {
+        Voice& voice = _voices[i];
+        // claim the slot so concurrent adds can't both take it
+        if (InterlockedCompareExchange(&voice.state, voiceClaimed, voiceFree) != voiceFree) {
+            continue;
         }
-        if (hardKill) {
-            _error = PW_THREAD_ABORT;
-            // note: hard kills are not good as they could leave the client process
-            //       in an inconsistent state
-            if (TerminateThread(_waveThread, 0) == FALSE) {
-                // XXX: how to handle a thread that wont die?
+        voice.proc = proc;
+        voice.user = user;
+        InterlockedExchange(&voice.gain, floatBits(gain));
+        // a writer late for the slot's last voice may still be in the ring
+        _waitWriters(voice);
+        if (ringFrames) {
+            // rounded up to a power of two like the output push ring
+            uint32_t capacity = 1;
+            while (capacity < ringFrames * _channels * sizeof(float)) {
+                capacity <<= 1;
             }
+            voice.ring.init(capacity);
+        } else {
+            voice.ring.release();
         }
-        _waveThread = NULL;
-    }
-    if (_hwo) {
-        if (!MMOK(waveOutClose(_hwo))) {
-            _error = PW_WAVEOUTCLOSE_ERROR;
-            return false;
-        }
-        _hwo = NULL;
+        // publish the voice to the wave thread
+        atomicStore(voice.state, voiceActive);
+        return int32_t(i);
     }
-    if (_waveEvent) {
-        if (CloseHandle(_waveEvent) == FALSE) {
-            _error = PW_CLOSEHANDLE_ERROR;
-        }
-        _waveEvent = NULL;
+    return -1;
+}
+
+size_t MixerDetail::writeStream(int32_t index, const float* data, size_t numFrames)
+{
+    Voice* voice = _voice(index);
+    if (!voice) {
+        return 0;
     }
-    memset(&_wavehdr, 0, sizeof(_wavehdr));
-    memset(&_info, 0, sizeof(_info));
-    // release the raw allocation
-    if (_rawAlloc) {
-        delete[] _rawAlloc;
+    // announce the write before looking at the state so removeVoice() can
+    // not free the ring underneath it
+    InterlockedIncrement(&voice->writers);
+    size_t count = 0;
+    if (atomicLoad(voice->state) == voiceActive && voice->ring.valid()) {
+        const size_t frameBytes = _channels * sizeof(float);
+        const size_t space = voice->ring.space() / frameBytes;
+        count = numFrames < space ? numFrames : space;
+        count = voice->ring.write(data, count * frameBytes) / frameBytes;
     }
-    return true;
+    InterlockedDecrement(&voice->writers);
+    return count;
 }
 
-bool Detail::start()
+bool MixerDetail::setGain(int32_t index, float gain)
 {
-    if (!_waveThread) {
+    Voice* voice = _voice(index);
+    if (!voice || atomicLoad(voice->state) != voiceActive) {
         return false;
     }
-    ResumeThread(_waveThread);
+    InterlockedExchange(&voice->gain, floatBits(gain));
     return true;
 }
 
-bool Detail::pause()
+bool MixerDetail::removeVoice(int32_t index)
 {
-    if (!_waveThread) {
+    Voice* voice = _voice(index);
+    if (!voice) {
+        return false;
+    }
+    // from a voice callback the period can not be waited for, the wave
+    // thread frees the voice itself once it has finished mixing
+    if ((atomicLoad(_epoch) & 1) && atomicLoad(_mixThread) == uint32_t(GetCurrentThreadId())) {
+        return InterlockedCompareExchange(&voice->state, voiceReleasing, voiceActive) ==
+               voiceActive;
+    }
+    if (InterlockedCompareExchange(&voice->state, voiceRetired, voiceActive) != voiceActive) {
         return false;
     }
-    SuspendThread(_waveThread);
+    _waitWriters(*voice);
+    // if a period is being mixed it may have seen the voice as active, wait
+    // for it to finish so the caller is free to release the voice user data
+    const uint32_t epoch = atomicLoad(_epoch);
+    if (epoch & 1) {
+        while (atomicLoad(_epoch) == epoch) {
+            Sleep(0);
+        }
+    }
+    voice->ring.release();
+    voice->proc = NULL;
+    voice->user = NULL;
+    atomicStore(voice->state, voiceFree);
     return true;
 }
 
-// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveOut Facade
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Mixer Facade
 
-WaveOut::WaveOut()
-    : _detail(new Detail)
+Mixer::Mixer()
+    : _detail(new MixerDetail)
 {
     assert(_detail);
 }
 
-WaveOut::~WaveOut()
+Mixer::~Mixer()
 {
     assert(_detail);
     delete _detail;
 }
 
-bool WaveOut::open(const WaveInfo& info)
+bool Mixer::open(const WaveInfo& info, uint32_t maxVoices)
 {
     assert(_detail);
-    return _detail->open(info);
+    return _detail->open(info, maxVoices);
 }
 
-bool WaveOut::start()
+bool Mixer::start()
 {
     assert(_detail);
-    return _detail->start();
+    return _detail->_output.start();
 }
 
-bool WaveOut::pause()
+bool Mixer::pause()
 {
     assert(_detail);
-    return _detail->pause();
+    return _detail->_output.pause();
 }
 
-bool WaveOut::close()
+bool Mixer::close()
 {
     assert(_detail);
     return _detail->close();
 }
 
-uint32_t WaveOut::lastError() const
+int32_t Mixer::addVoice(VoiceProc proc, void* user, float gain)
 {
     assert(_detail);
-    return _detail->lastError();
+    if (proc == nullptr) {
+        return -1;
+    }
+    return _detail->addVoice(proc, user, gain, 0);
+}
+
+int32_t Mixer::addStream(uint32_t numFrames, float gain)
+{
+    assert(_detail);
+    if (numFrames == 0 || numFrames > (1u << 22)) {
+        return -1;
+    }
+    return _detail->addVoice(NULL, NULL, gain, numFrames);
+}
+
+size_t Mixer::writeStream(int32_t voice, const float* data, size_t numFrames)
+{
+    assert(_detail);
+    return _detail->writeStream(voice, data, numFrames);
+}
+
+bool Mixer::setGain(int32_t voice, float gain)
+{
+    assert(_detail);
+    return _detail->setGain(voice, gain);
+}
+
+bool Mixer::removeVoice(int32_t voice)
+{
+    assert(_detail);
+    return _detail->removeVoice(voice);
+}
+
+WaveOut& Mixer::output()
+{
+    assert(_detail);
+    return _detail->_output;
 }
 
 } // namespace PicoWave
+
+#endif // _WIN32
@@ -15,21 +15,220 @@ enum {
     PW_WAVEOUTWRITE_ERROR,
     PW_WAVEOUTPREPHDR_ERROR,
     PW_CLOSEHANDLE_ERROR,
+    PW_COINITIALIZE_ERROR,
+    PW_WASAPI_DEVICE_ERROR,
+    PW_WASAPI_INITIALIZE_ERROR,
+    PW_WASAPI_BUFFER_ERROR,
+    PW_WASAPI_START_ERROR,
+    PW_THREADPRIORITY_ERROR,
+    PW_THREADAFFINITY_ERROR,
+    PW_FILE_ERROR,
+    PW_GROUP_ERROR,
+    PW_DEVICE_LOST,
+    PW_WAVEINOPEN_ERROR,
+    PW_WAVEINPREPHDR_ERROR,
+    PW_WAVEINADDBUFFER_ERROR,
+    PW_WAVEINSTART_ERROR,
+    PW_QUEUE_FULL,
 };
 
+enum {
+    PW_BACKEND_WAVEOUT,             // winmm waveOut (default)
+    PW_BACKEND_WASAPI_SHARED,       // wasapi event driven, shared mode
+    PW_BACKEND_WASAPI_EXCLUSIVE,    // wasapi event driven, exclusive mode
+    PW_BACKEND_NULL,                // no device, render as fast as possible
+    PW_BACKEND_NULL_CLOCKED,        // no device, render at the sample rate
+    PW_BACKEND_ALSA,                // alsa, the linux build maps PW_BACKEND_WAVEOUT here
+};
+
+enum {
+    PW_PRIORITY_DEFAULT,            // leave the wave thread at normal priority
+    PW_PRIORITY_MMCSS,              // register with mmcss as "Pro Audio"
+    PW_PRIORITY_TIME_CRITICAL,      // THREAD_PRIORITY_TIME_CRITICAL
+};
+
+enum {
+    PW_CALLBACK_PCM,                // callback renders in the device format
+    PW_CALLBACK_FLOAT32,            // callback renders interleaved float32
+};
+
+enum {
+    PW_DITHER_NONE,                 // truncate float32 to the device format
+    PW_DITHER_TPDF,                 // add triangular dither before quantizing
+};
+
+enum {
+    PW_SAMPLE_INT,                  // integer pcm (unsigned for 8 bit)
+    PW_SAMPLE_FLOAT,                // ieee float, bitDepth must be 32
+};
+
+enum {
+    PW_RESAMPLE_FAST,               // 16 taps per phase
+    PW_RESAMPLE_MEDIUM,             // 32 taps per phase
+    PW_RESAMPLE_BEST,               // 64 taps per phase
+};
+
+enum {
+    PW_HISTOGRAM_BUCKETS = 8,       // render time histogram, see WaveStats
+};
+
+struct WaveGroup;
+struct WaveOut;
+
 typedef void (*WaveProc)(
     void* buffer,           // audio buffer data pointer
+                            //   (float* and 32 byte aligned for PW_CALLBACK_FLOAT32)
     size_t bufferSize,      // audio buffer size in bytes
     void* user              // opaque user data pointer
 );
 
+// a period whose render ran past its playback time
+struct WaveDeadline {
+    uint64_t period;        // index of the period since open()
+    int64_t qpcTime;        // QueryPerformanceCounter time the render began
+    double renderUs;        // time spent rendering the period
+    double budgetUs;        // playback duration of the period
+};
+
+typedef void (*DeadlineProc)(
+    const WaveDeadline& report, // the late period
+    void* user              // opaque user data pointer
+);
+
 struct WaveInfo {
-    uint32_t sampleRate;    // sample rate in hz  (44100, 22050, ...)
-    uint32_t bitDepth;      // bit depth in bits  (16, 8)
-    uint32_t channels;      // number of channels (2, 1)
-    uint32_t bufferSize;    // audio buffer size in bytes
+    uint32_t sampleRate;    // sample rate in hz  (44100, 48000, 96000, ...)
+    uint32_t bitDepth;      // bit depth in bits  (8, 16, 24, 32)
+    uint32_t channels;      // number of channels (1..8)
+    uint32_t bufferSize;    // audio buffer size in samples per channel
     WaveProc callback;      // audio rendering callback function
     void* callbackData;     // user data passed to callback
+    uint32_t backend;       // output backend     (PW_BACKEND_WAVEOUT, ...)
+    uint32_t numBuffers;    // number of periods in the ring (2..256, 0 for 4)
+    uint32_t periodSize;    // period size in samples per channel
+                            //   (0 to split bufferSize over numBuffers)
+    uint32_t pushSize;      // push ring size in samples per channel
+                            //   (0 to render with the callback instead)
+    uint32_t priority;      // wave thread priority (PW_PRIORITY_DEFAULT, ...)
+    uint64_t affinity;      // wave thread cpu affinity mask (0 for any cpu)
+    uint32_t callbackFormat;// sample format for callback and push ring
+                            //   (PW_CALLBACK_PCM, PW_CALLBACK_FLOAT32)
+    uint32_t dither;        // float32 dither mode (PW_DITHER_NONE, ...)
+    const char* wavPath;    // wav file the null backends stream output to
+                            //   (NULL to discard the output)
+    WaveGroup* group;       // open group to share a service thread with
+                            //   (NULL for a private thread, priority and
+                            //    affinity then come from the group)
+    uint32_t device;        // device id from enumerateDevices()
+                            //   (0 for the system default / wave mapper)
+    uint32_t sampleFormat;  // device sample format (PW_SAMPLE_INT, ...)
+    uint32_t channelMask;   // SPEAKER_* position of each channel
+                            //   (0 for the default layout of the count)
+    uint32_t contentRate;   // rate the callback renders at, resampled to
+                            //   sampleRate (0 for sampleRate, needs
+                            //   PW_CALLBACK_FLOAT32 when it differs)
+    uint32_t resampleQuality; // resampler filter length (PW_RESAMPLE_FAST, ...)
+    uint32_t fadeFrames;    // fade length for start() and pause() in frames
+                            //   (0 to pause the device immediately, needs
+                            //    PW_CALLBACK_FLOAT32 otherwise)
+    uint32_t preroll;       // nonzero to fill the ring from the callback in
+                            //   the first start() rather than priming it
+                            //   with silence in open()
+    void* bufferMemory;     // caller owned memory for the waveOut header ring
+                            //   (NULL to allocate, see ringMemorySize())
+    size_t bufferMemorySize;// size of bufferMemory in bytes
+    uint32_t bufferAlign;   // alignment of each period in bytes, a power of
+                            //   two that bufferMemory must also meet
+                            //   (0 for 16)
+    uint32_t adaptive;      // nonzero to start with two periods queued and
+                            //   grow toward numBuffers on underruns,
+                            //   shrinking back after a stable stretch
+    WaveOut* duplex;        // capture only: open output whose thread services
+                            //   the capture right before each render
+                            //   (NULL for a private capture thread)
+    DeadlineProc deadlineProc; // called for every period rendered past its
+                            //   budget, from a reporting thread rather than
+                            //   the wave thread (NULL for no reports)
+    void* deadlineData;     // user data passed to deadlineProc
+    const char* sourcePath; // wav file streamed from a memory mapping in
+                            //   place of the callback or push ring, stored
+                            //   in the callbackFormat at the rate rendered
+                            //   (NULL for none, see describeWav())
+    uint32_t sourceLoop;    // nonzero to loop the source file, otherwise
+                            //   silence follows its end
+};
+
+struct WaveDevice {
+    uint32_t id;            // value for WaveInfo::device
+    char name[64];          // utf-8 device name
+    uint32_t sampleRate;    // native format of the device
+    uint32_t bitDepth;
+    uint32_t channels;
+};
+
+// list the output devices of a backend, fills up to maxDevices entries and
+// returns the number of devices present. ids stay valid until a device is
+// added or removed.
+uint32_t enumerateDevices(uint32_t backend, WaveDevice* out, uint32_t maxDevices);
+
+// the linux build (picowave_alsa.cpp) is a separate, smaller device layer
+// over the same header rather than a port of the windows one. it provides:
+//
+//   WaveOut with a callback or a push ring, PCM or FLOAT32 callbacks, dither,
+//   setGain(), setCallback(), startAt(), stats() and position()
+//   startOutputs() and enumerateDevices(), devices report a name only
+//
+// everything else is windows only. open() fails with PW_WAVEINFO_ERROR if any
+// of backend (other than PW_BACKEND_WAVEOUT or PW_BACKEND_ALSA), group,
+// duplex, contentRate, fadeFrames, preroll, bufferMemory, bufferAlign,
+// adaptive, deadlineProc, sourcePath, wavPath or channelMask is set, or with
+// neither a callback nor a push ring. acquire() and commit() always fail, and
+// stats() leaves outOfOrder at 0 and queueDepth at numBuffers. the
+// declarations below and WaveIn, WaveGroup and Mixer are not declared at all
+#if defined(_WIN32)
+
+// list the capture devices of a backend, ids are for WaveIn and follow the
+// same rules as enumerateDevices()
+uint32_t enumerateCaptureDevices(uint32_t backend, WaveDevice* out, uint32_t maxDevices);
+
+// fill in the sampleRate, bitDepth, channels and sampleFormat of info from a
+// wav file so a device can be opened to play it without conversion
+bool describeWav(const char* path, WaveInfo& info);
+
+// bytes needed for WaveInfo::bufferMemory to hold the header ring
+size_t ringMemorySize(const WaveInfo& info);
+
+#endif // _WIN32
+
+struct WaveStats {
+    uint64_t buffersSubmitted;  // periods handed to the device
+    uint64_t underruns;         // wakes that found the device had starved or
+                                //   more than one period to refill
+    uint64_t outOfOrder;        // headers the device completed out of order
+    double callbackMinUs;       // time spent rendering a single period
+    double callbackAvgUs;
+    double callbackMaxUs;
+    double submitMinUs;         // time from a wave thread wake to the last
+    double submitAvgUs;         //   period it submitted
+    double submitMaxUs;
+    uint64_t recoveries;        // times the stream moved to a new device after
+                                //   the old one was lost or the default changed
+    uint32_t queueDepth;        // periods currently kept queued at the device
+    uint64_t deadlineMisses;    // periods that took longer to render than play
+    uint64_t renderHistogram[PW_HISTOGRAM_BUCKETS];
+                                // periods by render time in quarters of their
+                                //   budget, the last bucket is open ended
+    double startLateUs;         // time the last startAt() released the device
+                                //   after its due time (0 after start())
+    uint64_t callbackSwaps;     // setCallback() calls the service thread has
+                                //   applied, see setCallback()
+};
+
+struct WavePosition {
+    uint64_t framesPlayed;      // frames the device reports as played
+    uint64_t framesSubmitted;   // frames handed to the device, including any
+                                //   left unplayed on a device that was lost
+    int64_t qpcTime;            // QueryPerformanceCounter time of framesPlayed
+                                //   (CLOCK_MONOTONIC nanoseconds on linux)
 };
 
 struct WaveOut {
@@ -41,14 +240,173 @@ struct WaveOut {
 
     bool start();
 
+    // start() at a QueryPerformanceCounter time, see startOutputs()
+    bool startAt(int64_t qpcTime);
+
     bool pause();
 
+    // waits for a running callback to return, so never call it from one
     bool close();
 
+    // queue audio for playback when opened with a push ring, returns the
+    // number of bytes accepted (whole frames only)
+    size_t write(const void* data, size_t size);
+
+    // number of bytes that can currently be written without blocking
+    size_t available() const;
+
+    // snapshot of the wave thread counters since open()
+    WaveStats stats() const;
+
+    // sample accurate playback clock since open()
+    bool position(WavePosition& out) const;
+
+    // direct mode (no callback or push ring): the next free period buffer
+    // to render into in the device format, waiting up to timeoutMs for one
+    // to come back. returns NULL if none is free yet
+    void* acquire(size_t& size, uint32_t timeoutMs);
+
+    // submit the buffer returned by acquire()
+    bool commit();
+
+    // these may be called from any thread while the stream runs, they are
+    // queued without locking and take effect at the start of the next period.
+    // PW_QUEUE_FULL is reported if the service thread has fallen behind.
+
+    // ramp the output gain linearly over rampFrames (0 to jump), fading to
+    // zero and back is a gain change like any other (PW_CALLBACK_FLOAT32)
+    bool setGain(float gain, uint32_t rampFrames);
+
+    // replace the callback and its user data together. calls are applied in
+    // the order they were queued, so once stats().callbackSwaps reaches the
+    // number of calls made so far the callbacks they replaced will not be
+    // called again and their data may be freed. close() is the other point
+    // after which no callback data is used.
+    bool setCallback(WaveProc callback, void* callbackData);
+
     uint32_t lastError() const;
 
 protected:
+    friend struct InDetail;
+    friend bool startOutputs(WaveOut* const*, uint32_t, int64_t, double*);
     struct Detail* _detail;
 };
 
+// start several outputs on the same sample. every ring is prerolled first,
+// then the calling thread waits for qpcTime (0 for as soon as they are ready)
+// and releases the devices back to back. skewUs receives the time between the
+// first and the last release if not NULL, and WaveStats::startLateUs of each
+// output how long after qpcTime it was released. qpcTime is CLOCK_MONOTONIC
+// nanoseconds on linux.
+bool startOutputs(WaveOut* const* outputs, uint32_t count, int64_t qpcTime, double* skewUs);
+
+#if defined(_WIN32)
+
+// audio capture through the same header ring and event thread as WaveOut
+//
+// each filled period is handed to the callback in the device format, or
+// queued for read() when opened with a push ring. underruns count periods
+// lost because the device or the push ring overflowed. waveOut, shared and
+// exclusive wasapi are supported, callbackFormat must be PW_CALLBACK_PCM.
+// a duplex capture must be closed before its output, and a wasapi capture
+// can only ride on a wasapi or grouped output.
+struct WaveIn {
+
+    WaveIn();
+    ~WaveIn();
+
+    bool open(const WaveInfo& info);
+
+    bool start();
+
+    bool pause();
+
+    bool close();
+
+    // take captured audio when opened with a push ring, returns the number
+    // of bytes read (whole frames only)
+    size_t read(void* data, size_t size);
+
+    // number of bytes that can currently be read
+    size_t available() const;
+
+    // snapshot of the capture counters since open()
+    WaveStats stats() const;
+
+    uint32_t lastError() const;
+
+protected:
+    struct InDetail* _detail;
+};
+
+// a single service thread shared by several outputs
+//
+// members wait together with WaitForMultipleObjects so a set of devices costs
+// one wake per period instead of one thread each. up to 63 outputs may share
+// a group and the group must outlive all of them.
+struct WaveGroup {
+
+    WaveGroup();
+    ~WaveGroup();
+
+    // start the service thread (PW_PRIORITY_DEFAULT, ...)
+    bool open(uint32_t priority, uint64_t affinity);
+
+    // stop the service thread, all members must be closed first
+    bool close();
+
+    uint32_t lastError() const;
+
+protected:
+    friend struct Detail;
+    struct GroupDetail* _detail;
+};
+
+typedef void (*VoiceProc)(
+    float* buffer,          // interleaved float32 frames, 32 byte aligned
+    size_t numFrames,       // number of frames to render
+    void* user              // opaque user data pointer
+);
+
+struct Mixer {
+
+    Mixer();
+    ~Mixer();
+
+    // open the output with the mixer as its float32 callback, the callback,
+    // callbackData, callbackFormat and pushSize fields of info are ignored
+    bool open(const WaveInfo& info, uint32_t maxVoices);
+
+    bool start();
+
+    bool pause();
+
+    bool close();
+
+    // add a voice rendered by a callback once per period, returns the voice
+    // id or -1 if every voice is in use
+    int32_t addVoice(VoiceProc proc, void* user, float gain);
+
+    // add a voice fed through a ring of numFrames frames with writeStream()
+    int32_t addStream(uint32_t numFrames, float gain);
+
+    // queue frames for a stream voice, returns the number of frames accepted
+    size_t writeStream(int32_t voice, const float* data, size_t numFrames);
+
+    bool setGain(int32_t voice, float gain);
+
+    // once this returns the mixer will not touch the voice again. a voice
+    // callback may remove voices, including its own, which then stop at the
+    // end of the period being mixed
+    bool removeVoice(int32_t voice);
+
+    // the underlying output for stats, position and errors
+    WaveOut& output();
+
+protected:
+    struct MixerDetail* _detail;
+};
+
+#endif // _WIN32
+
 } // namespace Wave
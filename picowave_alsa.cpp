@@ -0,0 +1,1125 @@
+// picowave_alsa
+//
+// linux implementation of the WaveOut facade over alsa, built in place of
+// picowave.cpp with the same header. only the device layer lives here, the
+// rings, statistics and sample kernels come from picowave_internal.h:
+//
+//   g++ -O2 -std=c++11 -c picowave_alsa.cpp   (link with -lasound -lpthread)
+//
+// periods are rendered straight into the device's mmap area where the pcm
+// supports it, plugins without mmap fall back to snd_pcm_writei. groups,
+// capture, the mixer and the windows only WaveInfo options are not available
+// and open() rejects them, picowave.h lists exactly what this build covers.
+
+#if defined(__linux__)
+
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "picowave.h"
+#include "picowave_internal.h"
+
+namespace PicoWave {
+
+namespace {
+// monotonic clock in nanoseconds, stands in for qpc on this platform
+int64_t clockNow()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+// clockNow() ticks per second, for the shared Timing
+const int64_t clockFreq = 1000000000;
+
+bool alsaFormat(const WaveInfo& info, snd_pcm_format_t& out)
+{
+    if (info.sampleFormat == PW_SAMPLE_FLOAT) {
+        out = SND_PCM_FORMAT_FLOAT_LE;
+        return info.bitDepth == 32;
+    }
+    switch (info.bitDepth) {
+    case 8:
+        out = SND_PCM_FORMAT_U8;
+        return true;
+    case 16:
+        out = SND_PCM_FORMAT_S16_LE;
+        return true;
+    case 24:
+        out = SND_PCM_FORMAT_S24_3LE;
+        return true;
+    case 32:
+        out = SND_PCM_FORMAT_S32_LE;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// default and upper limit for the number of periods in the ring
+const uint32_t defaultBuffers = 4;
+const uint32_t maxBuffers = 256;
+
+bool isPowerOfTwo(size_t in)
+{
+    return 0 == (in & (in - 1));
+}
+
+// alsa pcm names of the playback devices, the first entry is device 1
+std::vector<std::string> playbackNames(std::vector<std::string>* descriptions)
+{
+    std::vector<std::string> names;
+    void** hints = NULL;
+    if (snd_device_name_hint(-1, "pcm", &hints) < 0) {
+        return names;
+    }
+    for (void** hint = hints; *hint; ++hint) {
+        char* name = snd_device_name_get_hint(*hint, "NAME");
+        char* desc = snd_device_name_get_hint(*hint, "DESC");
+        char* ioid = snd_device_name_get_hint(*hint, "IOID");
+        // a missing direction means the device does both
+        if (name && (ioid == NULL || strcmp(ioid, "Output") == 0)) {
+            names.push_back(name);
+            if (descriptions) {
+                descriptions->push_back(desc ? desc : name);
+            }
+        }
+        free(name);
+        free(desc);
+        free(ioid);
+    }
+    snd_device_name_free_hint(hints);
+    return names;
+}
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveOut Implementation
+
+struct Detail {
+
+    Detail()
+        : _pcm(NULL)
+        , _mmap(false)
+        , _canPause(false)
+        , _periodFrames(0)
+        , _bufferFrames(0)
+        , _wakeFd(-1)
+        , _threadValid(false)
+        , _stop(0)
+        , _running(0)
+        , _failed(0)
+        , _pausePending(false)
+        , _pauseOk(true)
+        , _threadDone(false)
+        , _floatBuffer(NULL)
+        , _convert(NULL)
+        , _ramp(NULL)
+        , _framesSubmitted(0)
+        , _error(PW_OK)
+    {
+        _stats.reset();
+        _dither.seed();
+        memset(&_info, 0, sizeof(_info));
+        pthread_mutex_init(&_deviceLock, NULL);
+        pthread_cond_init(&_pauseDone, NULL);
+    }
+
+    ~Detail()
+    {
+        close();
+        pthread_cond_destroy(&_pauseDone);
+        pthread_mutex_destroy(&_deviceLock);
+    }
+
+    bool open(const WaveInfo& info);
+
+    bool start();
+
+    bool pause();
+
+    bool close();
+
+    size_t write(const void* data, size_t size);
+
+    size_t available() const;
+
+    WaveStats stats() const;
+
+    bool position(WavePosition& out) const;
+
+    bool setGain(float gain, uint32_t rampFrames);
+
+    bool setCallback(WaveProc callback, void* callbackData);
+
+    uint32_t lastError() const
+    {
+        return _error;
+    }
+
+    // the two halves of start() for startOutputs()
+    bool arm();
+
+    bool release(int64_t due);
+
+protected:
+    bool _release();
+    bool _validate(const WaveInfo& info);
+    bool _openPcm();
+    bool _prime();
+    bool _wake();
+    bool _service();
+    bool _recover(int err);
+    void _render(uint8_t* buffer, size_t numFrames);
+    void _source(void* buffer, size_t bufferSize);
+    bool _post(const Command& cmd);
+    void _kick();
+
+    uint32_t _blockAlign() const
+    {
+        return (_info.channels * _info.bitDepth) / 8;
+    }
+
+    // bytes per frame handed to the callback or written to the push ring
+    uint32_t _sourceBlockAlign() const
+    {
+        if (_info.callbackFormat == PW_CALLBACK_FLOAT32) {
+            return _info.channels * sizeof(float);
+        }
+        return _blockAlign();
+    }
+
+    static void* _threadProc(void* param);
+    void _applyPause();
+
+    snd_pcm_t* _pcm;
+    // true if periods are rendered into the mmap area rather than written
+    bool _mmap;
+    bool _canPause;
+    snd_pcm_uframes_t _periodFrames;
+    snd_pcm_uframes_t _bufferFrames;
+    // slot 0 is the wake eventfd, the pcm's descriptors follow
+    std::vector<pollfd> _pollFds;
+    int _wakeFd;
+    pthread_t _thread;
+    bool _threadValid;
+    // alsa-lib does not lock a pcm against concurrent calls, so every call
+    // on _pcm after open() is made with this held. the service thread holds
+    // it across _service() and drops it only while _render() runs the
+    // callback, pause() hands its device calls to the service thread
+    mutable pthread_mutex_t _deviceLock;
+    uint32_t _stop;
+    // cleared while paused, the thread then only watches the wake eventfd
+    uint32_t _running;
+    uint32_t _failed;
+    // set by pause() under _deviceLock, the service thread applies it and
+    // signals _pauseDone, _threadDone marks the thread gone
+    pthread_cond_t _pauseDone;
+    bool _pausePending;
+    bool _pauseOk;
+    bool _threadDone;
+    PushRing _pushRing;
+    // a period in the device format for writei and wrapping mmap areas, and
+    // the float32 staging buffer
+    std::vector<uint8_t> _period;
+    float* _floatBuffer;
+    std::vector<float> _floatStore;
+    ConvertProc _convert;
+    RampProc _ramp;
+    DitherState _dither;
+    Controls _controls;
+    Counters _stats;
+    atomic64_t _framesSubmitted;
+    WaveInfo _info;
+    uint32_t _error;
+};
+
+bool Detail::_validate(const WaveInfo& info)
+{
+    const uint32_t numBuffers = info.numBuffers ? info.numBuffers : defaultBuffers;
+    if (numBuffers < 2 || numBuffers > maxBuffers) {
+        return false;
+    }
+    if (info.periodSize == 0) {
+        if (!isPowerOfTwo(info.bufferSize) || info.bufferSize < numBuffers) {
+            return false;
+        }
+        if (info.bufferSize % numBuffers) {
+            return false;
+        }
+    }
+    // the default backend is alsa here
+    if (info.backend != PW_BACKEND_WAVEOUT && info.backend != PW_BACKEND_ALSA) {
+        return false;
+    }
+    if (info.callback == nullptr && info.pushSize == 0) {
+        return false;
+    }
+    if (info.pushSize > (1u << 24)) {
+        return false;
+    }
+    // the windows only options
+    if (info.group || info.duplex || info.contentRate || info.fadeFrames || info.preroll ||
+        info.bufferMemory || info.bufferAlign || info.adaptive || info.deadlineProc ||
+        info.sourcePath || info.wavPath || info.channelMask) {
+        return false;
+    }
+    snd_pcm_format_t format;
+    if (info.sampleFormat > PW_SAMPLE_FLOAT || !alsaFormat(info, format)) {
+        return false;
+    }
+    if (info.sampleRate < 8000 || info.sampleRate > 384000) {
+        return false;
+    }
+    if (info.channels < 1 || info.channels > 8) {
+        return false;
+    }
+    if (info.callbackFormat != PW_CALLBACK_PCM &&
+        info.callbackFormat != PW_CALLBACK_FLOAT32) {
+        return false;
+    }
+    if (info.dither != PW_DITHER_NONE && info.dither != PW_DITHER_TPDF) {
+        return false;
+    }
+    if (info.priority > PW_PRIORITY_TIME_CRITICAL) {
+        return false;
+    }
+    return true;
+}
+
+bool Detail::open(const WaveInfo& info)
+{
+    if (_pcm || _threadValid) {
+        _error = PW_ALREADY_OPEN;
+        return false;
+    }
+    if (!_validate(info)) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    _info = info;
+    if (_info.numBuffers == 0) {
+        _info.numBuffers = defaultBuffers;
+    }
+    if (_info.periodSize == 0) {
+        _info.periodSize = _info.bufferSize / _info.numBuffers;
+    }
+    _stats.reset();
+    atomicStore64(_framesSubmitted, 0);
+    atomicStore(_stop, 0);
+    atomicStore(_running, 0);
+    atomicStore(_failed, 0);
+    _controls.reset(_info.callback, _info.callbackData);
+    if (_info.pushSize) {
+        uint32_t capacity = 1;
+        while (capacity < _info.pushSize * _sourceBlockAlign()) {
+            capacity <<= 1;
+        }
+        _pushRing.init(capacity);
+    }
+    if (!_openPcm()) {
+        return false;
+    }
+    // the device may have rounded the period, everything after uses its size
+    _period.assign(_periodFrames * _blockAlign(), 0);
+    if (_info.callbackFormat == PW_CALLBACK_FLOAT32) {
+        _floatStore.assign(_periodFrames * _info.channels + 8, 0.f);
+        // 32 byte alignment to match what the windows build hands callbacks
+        _floatBuffer = (float*)((uintptr_t(_floatStore.data()) + 31) & ~uintptr_t(31));
+        _convert = selectConvert(_info.bitDepth, _info.sampleFormat,
+            _info.dither == PW_DITHER_TPDF);
+        _ramp = selectRamp(_info.channels);
+        _dither.seed();
+    }
+    // queue a ring of silence so start() has something to play straight away
+    if (!_prime()) {
+        return false;
+    }
+    // slot 0 wakes the thread for start() and close()
+    _wakeFd = eventfd(0, EFD_NONBLOCK);
+    const int count = snd_pcm_poll_descriptors_count(_pcm);
+    if (_wakeFd < 0 || count <= 0) {
+        _error = PW_CREATEEVENT_ERROR;
+        return false;
+    }
+    _pollFds.resize(size_t(count) + 1);
+    _pollFds[0].fd = _wakeFd;
+    _pollFds[0].events = POLLIN;
+    if (snd_pcm_poll_descriptors(_pcm, &_pollFds[1], unsigned(count)) != count) {
+        _error = PW_CREATEEVENT_ERROR;
+        return false;
+    }
+    if (pthread_create(&_thread, NULL, _threadProc, this) != 0) {
+        _error = PW_CREATETHREAD_ERROR;
+        return false;
+    }
+    _threadValid = true;
+    // the thread parks until start(), so it can be configured from here
+    if (_info.priority != PW_PRIORITY_DEFAULT) {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        const int policy = SCHED_FIFO;
+        const int top = sched_get_priority_max(policy);
+        // the mmcss "Pro Audio" task sits a little below the very top
+        param.sched_priority = (_info.priority == PW_PRIORITY_MMCSS) ? top - 10 : top;
+        // without rtprio rights mmcss quietly stays at normal priority as it
+        // does when the windows service is disabled
+        if (pthread_setschedparam(_thread, policy, &param) != 0 &&
+            _info.priority == PW_PRIORITY_TIME_CRITICAL) {
+            _error = PW_THREADPRIORITY_ERROR;
+            return false;
+        }
+    }
+    if (_info.affinity) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (uint32_t cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; ++cpu) {
+            if (_info.affinity & (uint64_t(1) << cpu)) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        if (pthread_setaffinity_np(_thread, sizeof(set), &set) != 0) {
+            _error = PW_THREADAFFINITY_ERROR;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Detail::_openPcm()
+{
+    std::string name = "default";
+    if (_info.device) {
+        const std::vector<std::string> names = playbackNames(NULL);
+        if (_info.device > names.size()) {
+            _error = PW_WAVEOUTOPEN_ERROR;
+            return false;
+        }
+        name = names[_info.device - 1];
+    }
+    if (snd_pcm_open(&_pcm, name.c_str(), SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+        _pcm = NULL;
+        _error = PW_WAVEOUTOPEN_ERROR;
+        return false;
+    }
+    snd_pcm_format_t format;
+    alsaFormat(_info, format);
+    snd_pcm_hw_params_t* hw = NULL;
+    if (snd_pcm_hw_params_malloc(&hw) < 0) {
+        _error = PW_WAVEOUTOPEN_ERROR;
+        return false;
+    }
+    // mmap access renders in place, plugins that lack it are written to
+    bool ok = snd_pcm_hw_params_any(_pcm, hw) >= 0;
+    _mmap = ok && snd_pcm_hw_params_set_access(_pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+    if (ok && !_mmap) {
+        ok = snd_pcm_hw_params_set_access(_pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED) >= 0;
+    }
+    // no resampling in alsa-lib, the rate must be one the device runs at
+    ok = ok && snd_pcm_hw_params_set_rate_resample(_pcm, hw, 0) >= 0;
+    ok = ok && snd_pcm_hw_params_set_format(_pcm, hw, format) >= 0;
+    ok = ok && snd_pcm_hw_params_set_channels(_pcm, hw, _info.channels) >= 0;
+    ok = ok && snd_pcm_hw_params_set_rate(_pcm, hw, _info.sampleRate, 0) >= 0;
+    snd_pcm_uframes_t period = _info.periodSize;
+    unsigned int periods = _info.numBuffers;
+    ok = ok && snd_pcm_hw_params_set_period_size_near(_pcm, hw, &period, NULL) >= 0;
+    ok = ok && snd_pcm_hw_params_set_periods_near(_pcm, hw, &periods, NULL) >= 0;
+    ok = ok && snd_pcm_hw_params(_pcm, hw) >= 0;
+    ok = ok && snd_pcm_hw_params_get_period_size(hw, &_periodFrames, NULL) >= 0;
+    ok = ok && snd_pcm_hw_params_get_buffer_size(hw, &_bufferFrames) >= 0;
+    _canPause = ok && snd_pcm_hw_params_can_pause(hw) == 1;
+    snd_pcm_hw_params_free(hw);
+    if (!ok || _periodFrames == 0 || _bufferFrames < _periodFrames * 2) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    snd_pcm_sw_params_t* sw = NULL;
+    if (snd_pcm_sw_params_malloc(&sw) < 0) {
+        _error = PW_WAVEOUTOPEN_ERROR;
+        return false;
+    }
+    // wake once a period is free, and only ever start when start() says so
+    snd_pcm_uframes_t boundary = 0;
+    ok = snd_pcm_sw_params_current(_pcm, sw) >= 0;
+    ok = ok && snd_pcm_sw_params_get_boundary(sw, &boundary) >= 0;
+    ok = ok && snd_pcm_sw_params_set_avail_min(_pcm, sw, _periodFrames) >= 0;
+    ok = ok && snd_pcm_sw_params_set_start_threshold(_pcm, sw, boundary) >= 0;
+    ok = ok && snd_pcm_sw_params(_pcm, sw) >= 0;
+    snd_pcm_sw_params_free(sw);
+    if (!ok) {
+        _error = PW_WAVEOUTOPEN_ERROR;
+        return false;
+    }
+    _info.periodSize = uint32_t(_periodFrames);
+    _info.numBuffers = uint32_t(_bufferFrames / _periodFrames);
+    return true;
+}
+
+bool Detail::_prime()
+{
+    // fill the whole ring with silence, the device is prepared but stopped
+    memset(_period.data(), (_info.bitDepth == 8) ? 0x80 : 0, _period.size());
+    snd_pcm_uframes_t left = _bufferFrames;
+    while (left) {
+        const snd_pcm_uframes_t frames = left < _periodFrames ? left : _periodFrames;
+        if (_mmap) {
+            // mmap_begin only sees the space avail_update last measured
+            if (snd_pcm_avail_update(_pcm) < 0) {
+                _error = PW_WAVEOUTWRITE_ERROR;
+                return false;
+            }
+            const snd_pcm_channel_area_t* areas = NULL;
+            snd_pcm_uframes_t offset = 0, count = frames;
+            if (snd_pcm_mmap_begin(_pcm, &areas, &offset, &count) < 0 || count == 0) {
+                _error = PW_WAVEOUTWRITE_ERROR;
+                return false;
+            }
+            uint8_t* dst = (uint8_t*)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+            memcpy(dst, _period.data(), count * _blockAlign());
+            if (snd_pcm_mmap_commit(_pcm, offset, count) < 0) {
+                _error = PW_WAVEOUTWRITE_ERROR;
+                return false;
+            }
+            left -= count;
+        } else {
+            const snd_pcm_sframes_t wrote = snd_pcm_writei(_pcm, _period.data(), frames);
+            if (wrote <= 0) {
+                _error = PW_WAVEOUTWRITE_ERROR;
+                return false;
+            }
+            left -= snd_pcm_uframes_t(wrote);
+        }
+    }
+    atomicAdd64(_framesSubmitted, _bufferFrames);
+    return true;
+}
+
+// called with _deviceLock held, it is dropped while the period renders so a
+// callback may call position() or pause()
+void Detail::_render(uint8_t* buffer, size_t numFrames)
+{
+    pthread_mutex_unlock(&_deviceLock);
+    const int64_t begin = clockNow();
+    _controls.drain(_stats.swaps);
+    const size_t numSamples = numFrames * _info.channels;
+    if (_info.callbackFormat == PW_CALLBACK_FLOAT32) {
+        _source(_floatBuffer, numSamples * sizeof(float));
+        if (_controls.hasGain()) {
+            _controls.applyGain(_ramp, _floatBuffer, numFrames, _info.channels);
+        }
+        _convert(_floatBuffer, buffer, numSamples, (_info.dither == PW_DITHER_TPDF) ? &_dither : NULL);
+    } else {
+        _source(buffer, numFrames * _blockAlign());
+    }
+    const int64_t ns = clockNow() - begin;
+    _stats.callback.add(ns);
+    // the same quarter budget histogram as windows
+    const int64_t budget = int64_t(numFrames) * 1000000000 / int64_t(_info.sampleRate);
+    if (budget > 0) {
+        int64_t bucket = (ns * 4) / budget;
+        if (bucket >= PW_HISTOGRAM_BUCKETS) {
+            bucket = PW_HISTOGRAM_BUCKETS - 1;
+        }
+        atomicAdd64(_stats.histogram[bucket], 1);
+        if (ns > budget) {
+            atomicAdd64(_stats.misses, 1);
+        }
+    }
+    pthread_mutex_lock(&_deviceLock);
+}
+
+void Detail::_source(void* buffer, size_t bufferSize)
+{
+    if (_pushRing.valid()) {
+        const size_t got = _pushRing.read(buffer, bufferSize);
+        if (got < bufferSize) {
+            const bool unsigned8 =
+                _info.bitDepth == 8 && _info.callbackFormat == PW_CALLBACK_PCM;
+            memset((uint8_t*)buffer + got, unsigned8 ? 0x80 : 0, bufferSize - got);
+        }
+        return;
+    }
+    if (_controls.callback) {
+        _controls.callback(buffer, bufferSize, _controls.callbackData);
+    }
+}
+
+bool Detail::_service()
+{
+    snd_pcm_sframes_t avail = snd_pcm_avail_update(_pcm);
+    if (avail < 0) {
+        return _recover(int(avail));
+    }
+    // more than one period to refill means we woke late
+    if (snd_pcm_uframes_t(avail) >= _periodFrames * 2) {
+        atomicAdd64(_stats.underruns, 1);
+    }
+    const uint32_t blockAlign = _blockAlign();
+    while (snd_pcm_uframes_t(avail) >= _periodFrames) {
+        // a pause() from the callback or another thread stops the refill,
+        // the service thread applies it once this returns
+        if (!atomicLoad(_running)) {
+            break;
+        }
+        if (!_mmap) {
+            _render(_period.data(), _periodFrames);
+            // a signal may cut a write short, carry on until the whole
+            // period is queued
+            snd_pcm_uframes_t done = 0;
+            while (done < _periodFrames) {
+                const snd_pcm_sframes_t wrote = snd_pcm_writei(
+                    _pcm, _period.data() + done * blockAlign, _periodFrames - done);
+                if (wrote < 0) {
+                    return _recover(int(wrote));
+                }
+                done += snd_pcm_uframes_t(wrote);
+            }
+        } else {
+            const snd_pcm_channel_area_t* areas = NULL;
+            snd_pcm_uframes_t offset = 0, frames = _periodFrames;
+            int err = snd_pcm_mmap_begin(_pcm, &areas, &offset, &frames);
+            if (err < 0) {
+                return _recover(err);
+            }
+            uint8_t* dst = (uint8_t*)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+            if (frames == _periodFrames) {
+                // the common case, render straight into the device buffer
+                _render(dst, _periodFrames);
+                if (snd_pcm_mmap_commit(_pcm, offset, frames) < 0) {
+                    return _recover(-EPIPE);
+                }
+            } else {
+                // the period wraps the end of the ring, render it aside and
+                // copy it in two parts
+                _render(_period.data(), _periodFrames);
+                snd_pcm_uframes_t done = 0;
+                for (;;) {
+                    memcpy(dst, _period.data() + done * blockAlign, frames * blockAlign);
+                    if (snd_pcm_mmap_commit(_pcm, offset, frames) < 0) {
+                        return _recover(-EPIPE);
+                    }
+                    done += frames;
+                    if (done == _periodFrames) {
+                        break;
+                    }
+                    frames = _periodFrames - done;
+                    err = snd_pcm_mmap_begin(_pcm, &areas, &offset, &frames);
+                    if (err < 0) {
+                        return _recover(err);
+                    }
+                    dst = (uint8_t*)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+                }
+            }
+        }
+        atomicAdd64(_stats.submitted, 1);
+        atomicAdd64(_framesSubmitted, _periodFrames);
+        avail -= snd_pcm_sframes_t(_periodFrames);
+    }
+    return true;
+}
+
+// called from _service() with _deviceLock held
+bool Detail::_recover(int err)
+{
+    // an xrun or suspend leaves the pcm stopped, anything else is fatal
+    if (err == -EPIPE) {
+        atomicAdd64(_stats.underruns, 1);
+    }
+    bool ok = snd_pcm_recover(_pcm, err, 1) >= 0;
+    // the recovered pcm is prepared and empty, queue a ring of silence ahead
+    // of the next render and restart it
+    if (ok && snd_pcm_state(_pcm) == SND_PCM_STATE_PREPARED) {
+        ok = _prime() && snd_pcm_start(_pcm) >= 0;
+    }
+    if (ok) {
+        atomicAdd64(_stats.recoveries, 1);
+    } else {
+        _error = PW_DEVICE_LOST;
+    }
+    return ok;
+}
+
+bool Detail::_wake()
+{
+    const int64_t wake = clockNow();
+    const int64_t submitted = _stats.submitted;
+    pthread_mutex_lock(&_deviceLock);
+    const bool ok = _service();
+    pthread_mutex_unlock(&_deviceLock);
+    if (!ok) {
+        return false;
+    }
+    if (_stats.submitted != submitted) {
+        _stats.submit.add(clockNow() - wake);
+    }
+    return true;
+}
+
+void* Detail::_threadProc(void* param)
+{
+    assert(param);
+    Detail& self = *(Detail*)param;
+    for (;;) {
+        const bool running = atomicLoad(self._running) != 0;
+        // parked while paused, only the wake eventfd is watched
+        const nfds_t count = running ? nfds_t(self._pollFds.size()) : 1;
+        if (poll(self._pollFds.data(), count, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (self._pollFds[0].revents & POLLIN) {
+            uint64_t value = 0;
+            const ssize_t got = read(self._wakeFd, &value, sizeof(value));
+            (void)got;
+        }
+        if (atomicLoad(self._stop)) {
+            break;
+        }
+        self._applyPause();
+        if (!running || !atomicLoad(self._running)) {
+            continue;
+        }
+        unsigned short revents = 0;
+        pthread_mutex_lock(&self._deviceLock);
+        snd_pcm_poll_descriptors_revents(
+            self._pcm, &self._pollFds[1], unsigned(count - 1), &revents);
+        pthread_mutex_unlock(&self._deviceLock);
+        if ((revents & (POLLOUT | POLLERR)) == 0) {
+            continue;
+        }
+        if (!self._wake()) {
+            atomicStore(self._failed, 1);
+            break;
+        }
+    }
+    // release a pause() still waiting on a thread that will not answer
+    pthread_mutex_lock(&self._deviceLock);
+    self._threadDone = true;
+    if (self._pausePending) {
+        self._pausePending = false;
+        self._pauseOk = false;
+    }
+    pthread_cond_broadcast(&self._pauseDone);
+    pthread_mutex_unlock(&self._deviceLock);
+    return NULL;
+}
+
+// runs on the service thread between periods, so the device is never paused
+// or dropped while _service() is rendering into it
+void Detail::_applyPause()
+{
+    pthread_mutex_lock(&_deviceLock);
+    if (_pausePending) {
+        bool ok = true;
+        // a start() that came in first wins, the pcm is already running
+        if (!atomicLoad(_running)) {
+            if (_canPause) {
+                // the device keeps what is queued and stops mid period
+                ok = snd_pcm_pause(_pcm, 1) >= 0;
+            } else {
+                // without hardware pause the queue is dropped and refilled
+                // with silence, so start() plays from a fresh ring
+                ok = snd_pcm_drop(_pcm) >= 0 && snd_pcm_prepare(_pcm) >= 0 &&
+                     _prime();
+            }
+        }
+        _pausePending = false;
+        _pauseOk = ok;
+        pthread_cond_broadcast(&_pauseDone);
+    }
+    pthread_mutex_unlock(&_deviceLock);
+}
+
+void Detail::_kick()
+{
+    const uint64_t one = 1;
+    const ssize_t wrote = ::write(_wakeFd, &one, sizeof(one));
+    (void)wrote;
+}
+
+bool Detail::start()
+{
+    if (!arm()) {
+        return false;
+    }
+    pthread_mutex_lock(&_deviceLock);
+    atomicStore64(_stats.startLate, 0);
+    const bool ok = _release();
+    pthread_mutex_unlock(&_deviceLock);
+    return ok;
+}
+
+// the ring is primed by open() and pause(), there is nothing more to prepare
+bool Detail::arm()
+{
+    return _threadValid && !atomicLoad(_failed);
+}
+
+bool Detail::release(int64_t due)
+{
+    if (!arm()) {
+        return false;
+    }
+    pthread_mutex_lock(&_deviceLock);
+    const int64_t late = clockNow() - due;
+    atomicStore64(_stats.startLate, late > 0 ? uint64_t(late) : 0);
+    const bool ok = _release();
+    pthread_mutex_unlock(&_deviceLock);
+    return ok;
+}
+
+bool Detail::_release()
+{
+    bool ok = true;
+    if (!atomicLoad(_running)) {
+        const snd_pcm_state_t state = snd_pcm_state(_pcm);
+        if (state == SND_PCM_STATE_PAUSED) {
+            // carry on from the exact sample the device paused on
+            ok = snd_pcm_pause(_pcm, 0) >= 0;
+        } else if (state == SND_PCM_STATE_RUNNING) {
+            // a pause() from a callback not applied yet, nothing to undo
+        } else {
+            ok = snd_pcm_start(_pcm) >= 0;
+        }
+        if (ok) {
+            atomicStore(_running, 1);
+            _kick();
+        } else {
+            _error = PW_WASAPI_START_ERROR;
+        }
+    }
+    return ok;
+}
+
+bool Detail::pause()
+{
+    if (!_threadValid) {
+        return false;
+    }
+    pthread_mutex_lock(&_deviceLock);
+    if (_threadDone) {
+        pthread_mutex_unlock(&_deviceLock);
+        return false;
+    }
+    atomicStore(_running, 0);
+    _pausePending = true;
+    _kick();
+    bool ok = true;
+    // from a callback the thread applies it once the callback returns
+    if (!pthread_equal(pthread_self(), _thread)) {
+        while (_pausePending) {
+            pthread_cond_wait(&_pauseDone, &_deviceLock);
+        }
+        ok = _pauseOk;
+    }
+    pthread_mutex_unlock(&_deviceLock);
+    return ok;
+}
+
+bool Detail::close()
+{
+    atomicStore(_running, 0);
+    if (_threadValid) {
+        atomicStore(_stop, 1);
+        _kick();
+        // a running callback is waited for, the thread is never killed
+        pthread_join(_thread, NULL);
+        _threadValid = false;
+        _threadDone = false;
+        _pausePending = false;
+    }
+    if (_pcm) {
+        snd_pcm_drop(_pcm);
+        snd_pcm_close(_pcm);
+        _pcm = NULL;
+    }
+    if (_wakeFd >= 0) {
+        ::close(_wakeFd);
+        _wakeFd = -1;
+    }
+    _pollFds.clear();
+    _pushRing.release();
+    _period.clear();
+    _floatStore.clear();
+    _floatBuffer = NULL;
+    _convert = NULL;
+    _ramp = NULL;
+    memset(&_info, 0, sizeof(_info));
+    return true;
+}
+
+size_t Detail::write(const void* data, size_t size)
+{
+    if (!_pushRing.valid()) {
+        return 0;
+    }
+    const size_t count = size < _pushRing.space() ? size : _pushRing.space();
+    return _pushRing.write(data, count - (count % _sourceBlockAlign()));
+}
+
+size_t Detail::available() const
+{
+    if (!_pushRing.valid()) {
+        return 0;
+    }
+    const size_t count = _pushRing.space();
+    return count - (count % _sourceBlockAlign());
+}
+
+WaveStats Detail::stats() const
+{
+    WaveStats out;
+    memset(&out, 0, sizeof(out));
+    out.buffersSubmitted = atomicLoad64(_stats.submitted);
+    out.underruns = atomicLoad64(_stats.underruns);
+    out.recoveries = atomicLoad64(_stats.recoveries);
+    out.queueDepth = _info.numBuffers;
+    out.deadlineMisses = atomicLoad64(_stats.misses);
+    for (uint32_t i = 0; i < PW_HISTOGRAM_BUCKETS; ++i) {
+        out.renderHistogram[i] = atomicLoad64(_stats.histogram[i]);
+    }
+    out.startLateUs = double(atomicLoad64(_stats.startLate)) / 1000.0;
+    out.callbackSwaps = atomicLoad64(_stats.swaps);
+    _stats.callback.read(clockFreq, out.callbackMinUs, out.callbackAvgUs, out.callbackMaxUs);
+    _stats.submit.read(clockFreq, out.submitMinUs, out.submitAvgUs, out.submitMaxUs);
+    return out;
+}
+
+bool Detail::position(WavePosition& out) const
+{
+    if (!_pcm) {
+        return false;
+    }
+    pthread_mutex_lock(&_deviceLock);
+    // delay is how long a frame written now takes to reach the dac
+    snd_pcm_sframes_t delay = 0;
+    const int64_t before = clockNow();
+    const bool ok = snd_pcm_delay(_pcm, &delay) >= 0;
+    const int64_t after = clockNow();
+    // read under the lock so no period is committed between the two
+    const uint64_t submitted = atomicLoad64(_framesSubmitted);
+    pthread_mutex_unlock(&_deviceLock);
+    if (!ok) {
+        return false;
+    }
+    out.framesSubmitted = submitted;
+    out.framesPlayed = (uint64_t(delay) < submitted) ? submitted - uint64_t(delay) : 0;
+    out.qpcTime = before + (after - before) / 2;
+    return true;
+}
+
+bool Detail::_post(const Command& cmd)
+{
+    if (!_threadValid) {
+        return false;
+    }
+    if (!_controls.commands.post(cmd)) {
+        _error = PW_QUEUE_FULL;
+        return false;
+    }
+    return true;
+}
+
+bool Detail::setGain(float gain, uint32_t rampFrames)
+{
+    if (_info.callbackFormat != PW_CALLBACK_FLOAT32 || !(gain >= 0.f && gain <= 16.f)) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_GAIN;
+    cmd.gain = gain;
+    cmd.rampFrames = rampFrames;
+    return _post(cmd);
+}
+
+bool Detail::setCallback(WaveProc callback, void* callbackData)
+{
+    if (_info.callback == nullptr || callback == nullptr) {
+        _error = PW_WAVEINFO_ERROR;
+        return false;
+    }
+    Command cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.type = CMD_CALLBACK;
+    cmd.callback = callback;
+    cmd.callbackData = callbackData;
+    return _post(cmd);
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- WaveOut Facade
+
+WaveOut::WaveOut()
+    : _detail(new Detail)
+{
+    assert(_detail);
+}
+
+WaveOut::~WaveOut()
+{
+    assert(_detail);
+    delete _detail;
+}
+
+bool WaveOut::open(const WaveInfo& info)
+{
+    assert(_detail);
+    return _detail->open(info);
+}
+
+bool WaveOut::start()
+{
+    assert(_detail);
+    return _detail->start();
+}
+
+bool WaveOut::startAt(int64_t qpcTime)
+{
+    WaveOut* self = this;
+    return startOutputs(&self, 1, qpcTime, NULL);
+}
+
+bool WaveOut::pause()
+{
+    assert(_detail);
+    return _detail->pause();
+}
+
+bool WaveOut::close()
+{
+    assert(_detail);
+    return _detail->close();
+}
+
+size_t WaveOut::write(const void* data, size_t size)
+{
+    assert(_detail);
+    return _detail->write(data, size);
+}
+
+size_t WaveOut::available() const
+{
+    assert(_detail);
+    return _detail->available();
+}
+
+WaveStats WaveOut::stats() const
+{
+    assert(_detail);
+    return _detail->stats();
+}
+
+bool WaveOut::position(WavePosition& out) const
+{
+    assert(_detail);
+    return _detail->position(out);
+}
+
+// direct mode needs the caller to drive the device, which open() rejects here
+void* WaveOut::acquire(size_t& size, uint32_t)
+{
+    size = 0;
+    return NULL;
+}
+
+bool WaveOut::commit()
+{
+    return false;
+}
+
+bool WaveOut::setGain(float gain, uint32_t rampFrames)
+{
+    assert(_detail);
+    return _detail->setGain(gain, rampFrames);
+}
+
+bool WaveOut::setCallback(WaveProc callback, void* callbackData)
+{
+    assert(_detail);
+    return _detail->setCallback(callback, callbackData);
+}
+
+uint32_t WaveOut::lastError() const
+{
+    assert(_detail);
+    return _detail->lastError();
+}
+
+bool startOutputs(WaveOut* const* outputs, uint32_t count, int64_t qpcTime, double* skewUs)
+{
+    if (outputs == nullptr || count == 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        if (outputs[i] == nullptr || !outputs[i]->_detail->arm()) {
+            return false;
+        }
+    }
+    const int64_t due = qpcTime ? qpcTime : clockNow();
+    // sleep to within a millisecond, then spin out the rest. the caller's
+    // scheduling class is left alone as raising it needs rtprio rights
+    const int64_t spin = 1000000;
+    if (due - clockNow() > spin) {
+        timespec until;
+        until.tv_sec = time_t((due - spin) / 1000000000);
+        until.tv_nsec = long((due - spin) % 1000000000);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+        }
+    }
+    while (clockNow() < due) {
+    }
+    bool ok = true;
+    const int64_t first = clockNow();
+    for (uint32_t i = 0; i < count; ++i) {
+        // keep going so one failed device does not hold the others back
+        ok = outputs[i]->_detail->release(due) && ok;
+    }
+    const int64_t last = clockNow();
+    if (skewUs) {
+        *skewUs = double(last - first) / 1000.0;
+    }
+    return ok;
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Device Enumeration
+
+uint32_t enumerateDevices(uint32_t backend, WaveDevice* out, uint32_t maxDevices)
+{
+    if (backend != PW_BACKEND_WAVEOUT && backend != PW_BACKEND_ALSA) {
+        return 0;
+    }
+    if (out == nullptr) {
+        maxDevices = 0;
+    }
+    std::vector<std::string> descriptions;
+    const std::vector<std::string> names = playbackNames(&descriptions);
+    for (uint32_t i = 0; i < names.size() && i < maxDevices; ++i) {
+        WaveDevice& dev = out[i];
+        memset(&dev, 0, sizeof(dev));
+        dev.id = i + 1;
+        // the description is often several lines, the first names the card
+        const std::string& desc = descriptions[i];
+        const size_t end = desc.find('\n');
+        strncpy(dev.name, desc.substr(0, end).c_str(), sizeof(dev.name) - 1);
+    }
+    return uint32_t(names.size());
+}
+
+} // namespace PicoWave
+
+#endif // __linux__
@@ -0,0 +1,350 @@
+// picowave_bench
+//
+// opens a device with the given settings, drives it with a trivial callback
+// and reports wave thread timing and output latency so buffer settings can be
+// chosen per machine.
+//
+//   cl /O2 /EHsc picowave_bench.cpp picowave.cpp winmm.lib ole32.lib avrt.lib
+//
+//   usage: picowave_bench [options]
+//     -r <hz>       sample rate            (44100)
+//     -b <bits>     bit depth              (16)
+//     -c <count>    channels               (2)
+//     -p <samples>  period size            (512)
+//     -n <count>    number of periods      (4)
+//     -t <seconds>  run time               (10)
+//     -o <backend>  waveout, shared, exclusive, null, clocked (waveout)
+//     -d <id>       device id, see -l     (0, system default)
+//     -l            list devices of the backend and exit
+//     -m            register with mmcss
+//     -k            check the integer conversion kernels and exit
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <Windows.h>
+
+#include "picowave.h"
+#include "picowave_internal.h"
+
+using namespace PicoWave;
+
+namespace {
+
+struct Bench {
+    // qpc timestamp taken on entry to each callback
+    std::vector<LONGLONG> stamps;
+    LONG volatile count;
+    int silence;
+};
+
+void benchProc(void* buffer, size_t bufferSize, void* user)
+{
+    Bench& bench = *(Bench*)user;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    const LONG index = bench.count;
+    if (size_t(index) < bench.stamps.size()) {
+        bench.stamps[index] = now.QuadPart;
+        InterlockedExchange(&bench.count, index + 1);
+    }
+    memset(buffer, bench.silence, bufferSize);
+}
+
+struct Options {
+    WaveInfo info;
+    uint32_t seconds;
+    bool list;
+    bool kernels;
+};
+
+bool parseBackend(const char* name, uint32_t& out)
+{
+    const struct {
+        const char* name;
+        uint32_t backend;
+    } table[] = {
+        { "waveout", PW_BACKEND_WAVEOUT },
+        { "shared", PW_BACKEND_WASAPI_SHARED },
+        { "exclusive", PW_BACKEND_WASAPI_EXCLUSIVE },
+        { "null", PW_BACKEND_NULL },
+        { "clocked", PW_BACKEND_NULL_CLOCKED },
+    };
+    for (const auto& entry : table) {
+        if (strcmp(entry.name, name) == 0) {
+            out = entry.backend;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parseArgs(int argc, char** argv, Options& opt)
+{
+    memset(&opt, 0, sizeof(opt));
+    opt.info.sampleRate = 44100;
+    opt.info.bitDepth = 16;
+    opt.info.channels = 2;
+    opt.info.periodSize = 512;
+    opt.info.numBuffers = 4;
+    opt.info.backend = PW_BACKEND_WAVEOUT;
+    opt.seconds = 10;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "-m") == 0) {
+            opt.info.priority = PW_PRIORITY_MMCSS;
+            continue;
+        }
+        if (strcmp(arg, "-l") == 0) {
+            opt.list = true;
+            continue;
+        }
+        if (strcmp(arg, "-k") == 0) {
+            opt.kernels = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (strcmp(arg, "-r") == 0) {
+            opt.info.sampleRate = uint32_t(atoi(value));
+        } else if (strcmp(arg, "-b") == 0) {
+            opt.info.bitDepth = uint32_t(atoi(value));
+        } else if (strcmp(arg, "-c") == 0) {
+            opt.info.channels = uint32_t(atoi(value));
+        } else if (strcmp(arg, "-p") == 0) {
+            opt.info.periodSize = uint32_t(atoi(value));
+        } else if (strcmp(arg, "-n") == 0) {
+            opt.info.numBuffers = uint32_t(atoi(value));
+        } else if (strcmp(arg, "-d") == 0) {
+            opt.info.device = uint32_t(atoi(value));
+        } else if (strcmp(arg, "-t") == 0) {
+            opt.seconds = uint32_t(atoi(value));
+        } else if (strcmp(arg, "-o") == 0) {
+            if (!parseBackend(value, opt.info.backend)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return opt.info.periodSize && opt.seconds;
+}
+
+// value at fraction p of a sorted set
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    const size_t index = size_t(p * double(sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void report(const char* name, std::vector<double>& values)
+{
+    std::sort(values.begin(), values.end());
+    printf("  %-22s p50 %9.1f  p90 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f\n",
+        name,
+        percentile(values, 0.5),
+        percentile(values, 0.9),
+        percentile(values, 0.99),
+        percentile(values, 0.999),
+        values.empty() ? 0.0 : values.back());
+}
+
+void listDevices(uint32_t backend)
+{
+    WaveDevice devices[32];
+    const uint32_t count = enumerateDevices(backend, devices, 32);
+    printf("%u devices\n", count);
+    for (uint32_t i = 0; i < count && i < 32; ++i) {
+        const WaveDevice& dev = devices[i];
+        printf("  %2u  %-40s %6u hz %2u bits %u channels\n",
+            dev.id, dev.name, dev.sampleRate, dev.bitDepth, dev.channels);
+    }
+}
+
+// sample i of an integer device buffer as a signed code
+int32_t decodeSample(const uint8_t* data, size_t i, uint32_t bitDepth)
+{
+    switch (bitDepth) {
+    case 8:
+        return int32_t(data[i]) - 128;
+    case 24: {
+        const uint8_t* in = data + i * 3;
+        // shift the top byte up and back down to sign extend it
+        return int32_t(uint32_t(in[0]) << 8 | uint32_t(in[1]) << 16 | uint32_t(in[2]) << 24) >> 8;
+    }
+    case 32:
+        return ((const int32_t*)data)[i];
+    default:
+        return ((const int16_t*)data)[i];
+    }
+}
+
+// run the selected kernel and the scalar one over samples that land exactly
+// half way between two codes, where round half away from zero and the vector
+// units' ties to even disagree. both must give the even code at every
+// position, the buffer is long enough for a vector body and a scalar tail
+bool checkKernels()
+{
+    const uint32_t depths[] = { 8, 16, 24, 32 };
+    const size_t count = 67;
+    std::vector<float> store(count + 8);
+    // the kernels load 32 byte aligned float32 as the callback buffer is
+    float* src = (float*)((uintptr_t(store.data()) + 31) & ~uintptr_t(31));
+    std::vector<uint8_t> fast(count * 4), slow(count * 4);
+    bool ok = true;
+    for (uint32_t bitDepth : depths) {
+        const float scale = bitDepth == 8 ? 128.f
+                          : bitDepth == 24 ? 8388608.f
+                          : bitDepth == 32 ? 2147483648.f
+                          : 32768.f;
+        for (size_t i = 0; i < count; ++i) {
+            src[i] = (float(int32_t(i) - 33) + .5f) / scale;
+        }
+        const ConvertProc convert = selectConvert(bitDepth, PW_SAMPLE_INT, false);
+        ConvertProc scalar = convertScalar<FormatS16, false>;
+        if (bitDepth == 8) {
+            scalar = convertScalar<FormatU8, false>;
+        } else if (bitDepth == 24) {
+            scalar = convertScalar<FormatS24, false>;
+        } else if (bitDepth == 32) {
+            scalar = convertScalar<FormatS32, false>;
+        }
+        convert(src, fast.data(), count, NULL);
+        scalar(src, slow.data(), count, NULL);
+        uint32_t wrong = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const int32_t k = int32_t(i) - 33;
+            const int32_t even = (k & 1) ? k + 1 : k;
+            if (decodeSample(fast.data(), i, bitDepth) != even ||
+                decodeSample(slow.data(), i, bitDepth) != even) {
+                ++wrong;
+            }
+        }
+        printf("  %2u bit half lsb rounding  %s", bitDepth, wrong ? "FAILED" : "ok");
+        if (wrong) {
+            printf(" (%u of %u samples)", wrong, uint32_t(count));
+        }
+        printf("\n");
+        ok = ok && wrong == 0;
+    }
+    return ok;
+}
+
+void usage()
+{
+    printf("usage: picowave_bench [-r hz] [-b bits] [-c channels] [-p samples]\n");
+    printf("                      [-n periods] [-t seconds] [-d id] [-l] [-m] [-k]\n");
+    printf("                      [-o waveout|shared|exclusive|null|clocked]\n");
+}
+}
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    if (!parseArgs(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    if (opt.list) {
+        listDevices(opt.info.backend);
+        return 0;
+    }
+    if (opt.kernels) {
+        return checkKernels() ? 0 : 1;
+    }
+    WaveInfo& info = opt.info;
+    const double periodUs = 1000000.0 * info.periodSize / info.sampleRate;
+
+    // room for every expected callback plus headroom for a fast null backend
+    Bench bench;
+    const size_t expected = size_t(opt.seconds) * info.sampleRate / info.periodSize;
+    bench.stamps.resize(info.backend == PW_BACKEND_NULL ? expected * 64 : expected * 2);
+    bench.count = 0;
+    bench.silence = (info.bitDepth == 8) ? 0x80 : 0;
+    info.callback = benchProc;
+    info.callbackData = &bench;
+
+    WaveOut wave;
+    if (!wave.open(info)) {
+        printf("open failed with error %u\n", wave.lastError());
+        return 1;
+    }
+    printf("rate %u, bits %u, channels %u, period %u samples (%.1f us), %u periods\n",
+        info.sampleRate, info.bitDepth, info.channels, info.periodSize,
+        periodUs, info.numBuffers);
+    if (!wave.start()) {
+        printf("start failed with error %u\n", wave.lastError());
+        return 1;
+    }
+    LARGE_INTEGER freq, begin, end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&begin);
+    // poll the play position to measure how much audio is queued ahead of
+    // the dac, this is the latency a newly rendered sample will see
+    std::vector<double> latency;
+    const LONGLONG runTicks = LONGLONG(opt.seconds) * freq.QuadPart;
+    for (;;) {
+        Sleep(1);
+        WavePosition pos;
+        if (wave.position(pos)) {
+            const uint64_t queued = pos.framesSubmitted - pos.framesPlayed;
+            latency.push_back(1000000.0 * double(queued) / info.sampleRate);
+        }
+        QueryPerformanceCounter(&end);
+        if (end.QuadPart - begin.QuadPart >= runTicks) {
+            break;
+        }
+    }
+    const WaveStats stats = wave.stats();
+    wave.close();
+
+    // the wave thread has stopped so its samples can be read freely
+    const size_t count = size_t(bench.count);
+    const double toUs = 1000000.0 / double(freq.QuadPart);
+    std::vector<double> interval, jitter;
+    for (size_t i = 1; i < count; ++i) {
+        const double delta = double(bench.stamps[i] - bench.stamps[i - 1]) * toUs;
+        interval.push_back(delta);
+        jitter.push_back(delta > periodUs ? delta - periodUs : periodUs - delta);
+    }
+    const double elapsed = double(end.QuadPart - begin.QuadPart) / double(freq.QuadPart);
+    const double frames = double(stats.buffersSubmitted) * info.periodSize;
+
+    printf("\n%zu callbacks in %.2f s, %.0f frames/sec (%.2fx realtime)\n",
+        count, elapsed, frames / elapsed, frames / elapsed / info.sampleRate);
+    printf("\ncallback timing (us)\n");
+    report("callback interval", interval);
+    report("callback jitter", jitter);
+    printf("\nwave thread (us)       min        avg        max\n");
+    printf("  render            %9.1f  %9.1f  %9.1f\n",
+        stats.callbackMinUs, stats.callbackAvgUs, stats.callbackMaxUs);
+    printf("  wake to submit    %9.1f  %9.1f  %9.1f\n",
+        stats.submitMinUs, stats.submitAvgUs, stats.submitMaxUs);
+    printf("\nbuffers submitted %llu, underruns %llu, out of order %llu, recoveries %llu\n",
+        (unsigned long long)stats.buffersSubmitted,
+        (unsigned long long)stats.underruns,
+        (unsigned long long)stats.outOfOrder,
+        (unsigned long long)stats.recoveries);
+    printf("\nrender time by share of period (%llu over budget)\n",
+        (unsigned long long)stats.deadlineMisses);
+    for (uint32_t i = 0; i < PW_HISTOGRAM_BUCKETS; ++i) {
+        if (i + 1 < PW_HISTOGRAM_BUCKETS) {
+            printf("  %3u%% to %3u%%  %12llu\n", i * 25, (i + 1) * 25,
+                (unsigned long long)stats.renderHistogram[i]);
+        } else {
+            printf("  %3u%% and up   %12llu\n", i * 25,
+                (unsigned long long)stats.renderHistogram[i]);
+        }
+    }
+    printf("\noutput latency (us)\n");
+    report("queued at dac", latency);
+    return 0;
+}
@@ -0,0 +1,977 @@
+// picowave_internal
+//
+// the platform neutral half of the implementation, the push ring, command
+// queue, statistics and sample kernels that picowave.cpp and
+// picowave_alsa.cpp both build on. only those two and the kernel check in
+// picowave_bench include it.
+
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define PW_X86 1
+#endif
+
+#if defined(_WIN32)
+#include <Windows.h>
+#endif
+
+#if defined(PW_X86)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#include "picowave.h"
+
+namespace PicoWave {
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Atomics
+
+// counters shared between the service thread and the api, the rings and
+// queues below only touch them through these
+#if defined(_WIN32)
+typedef LONG volatile atomic32_t;
+typedef LONGLONG volatile atomic64_t;
+
+// counter load with acquire semantics
+inline uint32_t atomicLoad(const atomic32_t& value)
+{
+    const LONG out = value;
+    MemoryBarrier();
+    return uint32_t(out);
+}
+
+// counter store with release semantics
+inline void atomicStore(atomic32_t& value, uint32_t in)
+{
+    InterlockedExchange(&value, LONG(in));
+}
+
+// true if value held expected and now holds desired
+inline bool atomicCompareExchange(atomic32_t& value, uint32_t expected, uint32_t desired)
+{
+    return uint32_t(InterlockedCompareExchange(&value, LONG(desired), LONG(expected))) == expected;
+}
+
+// 64 bit loads are not atomic on 32 bit targets without an interlocked op
+inline int64_t atomicLoad64(const atomic64_t& value)
+{
+    return InterlockedCompareExchange64((atomic64_t*)&value, 0, 0);
+}
+
+inline void atomicStore64(atomic64_t& value, int64_t in)
+{
+    InterlockedExchange64(&value, in);
+}
+
+inline void atomicAdd64(atomic64_t& value, int64_t in)
+{
+    InterlockedExchangeAdd64(&value, in);
+}
+#else
+typedef uint32_t atomic32_t;
+typedef int64_t atomic64_t;
+
+inline uint32_t atomicLoad(const atomic32_t& value)
+{
+    return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+}
+
+inline void atomicStore(atomic32_t& value, uint32_t in)
+{
+    __atomic_store_n(&value, in, __ATOMIC_RELEASE);
+}
+
+inline bool atomicCompareExchange(atomic32_t& value, uint32_t expected, uint32_t desired)
+{
+    return __atomic_compare_exchange_n(
+        &value, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+inline int64_t atomicLoad64(const atomic64_t& value)
+{
+    return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+}
+
+inline void atomicStore64(atomic64_t& value, int64_t in)
+{
+    __atomic_store_n(&value, in, __ATOMIC_RELEASE);
+}
+
+inline void atomicAdd64(atomic64_t& value, int64_t in)
+{
+    __atomic_fetch_add(&value, in, __ATOMIC_ACQ_REL);
+}
+#endif
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Push Ring
+
+// lock free single producer, single consumer byte ring
+//
+// the producer only writes _head and the consumer only writes _tail, both
+// count bytes monotonically and wrap naturally since capacity is a power of
+// two.
+struct PushRing {
+
+    PushRing()
+        : _data(NULL)
+        , _mask(0)
+        , _head(0)
+        , _tail(0)
+    {
+    }
+
+    ~PushRing()
+    {
+        release();
+    }
+
+    void init(uint32_t capacity)
+    {
+        release();
+        _data = new uint8_t[capacity];
+        _mask = capacity - 1;
+        atomicStore(_head, 0);
+        atomicStore(_tail, 0);
+    }
+
+    void release()
+    {
+        if (_data) {
+            delete[] _data;
+            _data = NULL;
+        }
+        _mask = 0;
+    }
+
+    bool valid() const
+    {
+        return _data != NULL;
+    }
+
+    // bytes free for the producer
+    size_t space() const
+    {
+        return capacity() - (atomicLoad(_head) - atomicLoad(_tail));
+    }
+
+    // bytes waiting for the consumer
+    size_t used() const
+    {
+        return atomicLoad(_head) - atomicLoad(_tail);
+    }
+
+    // producer side
+    size_t write(const void* data, size_t size)
+    {
+        const uint32_t head = _head;
+        const uint32_t tail = atomicLoad(_tail);
+        const size_t count = _min(size, capacity() - (head - tail));
+        _copyIn(head & _mask, (const uint8_t*)data, count);
+        atomicStore(_head, head + uint32_t(count));
+        return count;
+    }
+
+    // consumer side
+    size_t read(void* data, size_t size)
+    {
+        const uint32_t tail = _tail;
+        const uint32_t head = atomicLoad(_head);
+        const size_t count = _min(size, head - tail);
+        _copyOut(tail & _mask, (uint8_t*)data, count);
+        atomicStore(_tail, tail + uint32_t(count));
+        return count;
+    }
+
+protected:
+    size_t capacity() const
+    {
+        return _data ? size_t(_mask) + 1 : 0;
+    }
+
+    static size_t _min(size_t a, size_t b)
+    {
+        return a < b ? a : b;
+    }
+
+    void _copyIn(uint32_t offset, const uint8_t* src, size_t count)
+    {
+        // copy in up to two parts to handle wrapping around the end
+        const size_t first = _min(count, capacity() - offset);
+        memcpy(_data + offset, src, first);
+        memcpy(_data, src + first, count - first);
+    }
+
+    void _copyOut(uint32_t offset, uint8_t* dst, size_t count) const
+    {
+        const size_t first = _min(count, capacity() - offset);
+        memcpy(dst, _data + offset, first);
+        memcpy(dst + first, _data, count - first);
+    }
+
+    uint8_t* _data;
+    uint32_t _mask;
+    atomic32_t _head;
+    atomic32_t _tail;
+};
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Command Queue
+
+enum {
+    CMD_GAIN,
+    CMD_CALLBACK,
+};
+
+// a parameter change posted by another thread
+struct Command {
+    uint32_t type;
+    float gain;
+    uint32_t rampFrames;
+    WaveProc callback;
+    void* callbackData;
+};
+
+// bounded queue with any number of producers and the service thread as the
+// only consumer
+//
+// each slot carries a sequence number, producers claim a slot by advancing
+// _tail and publish it by bumping its sequence, so no thread ever waits on
+// another to finish and the audio path takes no locks.
+struct CommandQueue {
+
+    static const uint32_t capacity = 64;
+
+    CommandQueue()
+    {
+        reset();
+    }
+
+    // only while no producer or consumer is active
+    void reset()
+    {
+        for (uint32_t i = 0; i < capacity; ++i) {
+            atomicStore(_slots[i].sequence, i);
+        }
+        atomicStore(_head, 0);
+        atomicStore(_tail, 0);
+    }
+
+    // producer side, false if the queue is full
+    bool post(const Command& cmd)
+    {
+        uint32_t pos = atomicLoad(_tail);
+        for (;;) {
+            Slot& slot = _slots[pos & (capacity - 1)];
+            const int32_t diff = int32_t(atomicLoad(slot.sequence) - pos);
+            if (diff == 0) {
+                if (atomicCompareExchange(_tail, pos, pos + 1)) {
+                    slot.cmd = cmd;
+                    atomicStore(slot.sequence, pos + 1);
+                    return true;
+                }
+                pos = atomicLoad(_tail);
+            } else if (diff < 0) {
+                // the consumer has not freed this slot yet
+                return false;
+            } else {
+                // another producer claimed it first
+                pos = atomicLoad(_tail);
+            }
+        }
+    }
+
+    // consumer side, commands come out in the order they were claimed
+    bool take(Command& out)
+    {
+        const uint32_t pos = _head;
+        Slot& slot = _slots[pos & (capacity - 1)];
+        if (atomicLoad(slot.sequence) != pos + 1) {
+            return false;
+        }
+        out = slot.cmd;
+        atomicStore(slot.sequence, pos + capacity);
+        atomicStore(_head, pos + 1);
+        return true;
+    }
+
+protected:
+    struct Slot {
+        atomic32_t sequence;
+        Command cmd;
+    };
+
+    Slot _slots[capacity];
+    atomic32_t _head;
+    atomic32_t _tail;
+};
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Statistics
+
+// running min, max and total of an interval in clock ticks, qpc on windows
+// and nanoseconds on linux
+//
+// only the service thread writes these, other threads may read at any time
+// so every store is atomic to keep the values whole.
+struct Timing {
+
+    void reset()
+    {
+        atomicStore64(_min, 0);
+        atomicStore64(_max, 0);
+        atomicStore64(_total, 0);
+        atomicStore64(_count, 0);
+    }
+
+    void add(int64_t ticks)
+    {
+        if (_count == 0 || ticks < _min) {
+            atomicStore64(_min, ticks);
+        }
+        if (ticks > _max) {
+            atomicStore64(_max, ticks);
+        }
+        atomicAdd64(_total, ticks);
+        atomicAdd64(_count, 1);
+    }
+
+    // report min, avg and max in microseconds given the ticks per second
+    void read(int64_t freq, double& min, double& avg, double& max) const
+    {
+        const double scale = 1000000.0 / double(freq);
+        const int64_t count = atomicLoad64(_count);
+        min = double(atomicLoad64(_min)) * scale;
+        max = double(atomicLoad64(_max)) * scale;
+        avg = count ? (double(atomicLoad64(_total)) * scale) / double(count) : 0.0;
+    }
+
+    atomic64_t _min;
+    atomic64_t _max;
+    atomic64_t _total;
+    atomic64_t _count;
+};
+
+struct Counters {
+
+    void reset()
+    {
+        atomicStore64(submitted, 0);
+        atomicStore64(underruns, 0);
+        atomicStore64(outOfOrder, 0);
+        atomicStore64(recoveries, 0);
+        atomicStore64(misses, 0);
+        atomicStore64(startLate, 0);
+        atomicStore64(swaps, 0);
+        for (atomic64_t& bucket : histogram) {
+            atomicStore64(bucket, 0);
+        }
+        callback.reset();
+        submit.reset();
+    }
+
+    atomic64_t submitted;
+    atomic64_t underruns;
+    atomic64_t outOfOrder;
+    atomic64_t recoveries;
+    atomic64_t misses;
+    // ticks from the due time of the last scheduled start to its release
+    atomic64_t startLate;
+    // setCallback() commands applied by the service thread
+    atomic64_t swaps;
+    atomic64_t histogram[PW_HISTOGRAM_BUCKETS];
+    Timing callback;
+    Timing submit;
+};
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Format Conversion
+
+#if defined(__GNUC__)
+#define PW_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define PW_TARGET_AVX2
+#endif
+
+// per lane xorshift state used to generate dither noise
+struct DitherState {
+    // seed each lane differently, zero would lock up xorshift
+    void seed()
+    {
+        for (uint32_t i = 0; i < 8; ++i) {
+            lanes[i] = 0x9e3779b9u * (i + 1);
+        }
+    }
+
+    uint32_t lanes[8];
+};
+
+// convert count float samples into the device format at dst, dither may be
+// NULL to disable dithering
+typedef void (*ConvertProc)(
+    const float* src, void* dst, size_t count, DitherState* dither);
+
+inline uint32_t xorshift(uint32_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// map random bits to a float in [0, 1)
+inline float uniform(uint32_t bits)
+{
+    union {
+        uint32_t i;
+        float f;
+    } out;
+    out.i = (bits >> 9) | 0x3f800000;
+    return out.f - 1.f;
+}
+
+// triangular noise in (-1, 1) lsb
+inline float tpdf(DitherState* dither)
+{
+    uint32_t& state = dither->lanes[0];
+    return uniform(xorshift(state)) - uniform(xorshift(state));
+}
+
+inline float clampUnit(float in)
+{
+    return in < -1.f ? -1.f : (in > 1.f ? 1.f : in);
+}
+
+// nearest, ties to even in the default rounding mode, the same as cvtps in
+// the vector kernels so a sample converts alike wherever it falls in a buffer
+inline int32_t roundToInt(float in)
+{
+    return int32_t(lrintf(in));
+}
+
+// device sample formats, each scales a clipped sample to its full range and
+// stores it rounded and saturated
+struct FormatU8 {
+    static float scale()
+    {
+        return 128.f;
+    }
+    static void store(void* dst, size_t i, float s)
+    {
+        const int32_t v = roundToInt(s) + 128;
+        ((uint8_t*)dst)[i] = uint8_t(v < 0 ? 0 : (v > 255 ? 255 : v));
+    }
+};
+
+struct FormatS16 {
+    static float scale()
+    {
+        return 32768.f;
+    }
+    static void store(void* dst, size_t i, float s)
+    {
+        const int32_t v = roundToInt(s);
+        ((int16_t*)dst)[i] = int16_t(v < -32768 ? -32768 : (v > 32767 ? 32767 : v));
+    }
+};
+
+struct FormatS24 {
+    static float scale()
+    {
+        return 8388608.f;
+    }
+    // packed little endian, three bytes per sample
+    static void store(void* dst, size_t i, float s)
+    {
+        int32_t v = roundToInt(s);
+        v = v < -8388608 ? -8388608 : (v > 8388607 ? 8388607 : v);
+        uint8_t* out = (uint8_t*)dst + i * 3;
+        out[0] = uint8_t(v);
+        out[1] = uint8_t(v >> 8);
+        out[2] = uint8_t(v >> 16);
+    }
+};
+
+// largest float below 2^31, anything above it would wrap when converted
+const float maxS32 = 2147483520.f;
+
+struct FormatS32 {
+    static float scale()
+    {
+        return 2147483648.f;
+    }
+    static void store(void* dst, size_t i, float s)
+    {
+        ((int32_t*)dst)[i] = roundToInt(s > maxS32 ? maxS32 : s);
+    }
+};
+
+struct FormatF32 {
+    static float scale()
+    {
+        return 1.f;
+    }
+    static void store(void* dst, size_t i, float s)
+    {
+        ((float*)dst)[i] = s;
+    }
+};
+
+// one loop per format and dither setting so neither is tested per sample
+template <typename format_t, bool dithered>
+void convertScalar(const float* src, void* dst, size_t count, DitherState* dither)
+{
+    for (size_t i = 0; i < count; ++i) {
+        float s = clampUnit(src[i]) * format_t::scale();
+        if (dithered) {
+            s += tpdf(dither);
+        }
+        format_t::store(dst, i, s);
+    }
+}
+
+#if defined(PW_X86)
+inline __m128i xorshift(__m128i& state)
+{
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+    state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+    state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+    return state;
+}
+
+inline __m128 uniform(__m128i bits)
+{
+    const __m128i one = _mm_set1_epi32(0x3f800000);
+    const __m128 out = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(bits, 9), one));
+    return _mm_sub_ps(out, _mm_set1_ps(1.f));
+}
+
+inline __m128 tpdf(__m128i& state)
+{
+    const __m128 a = uniform(xorshift(state));
+    return _mm_sub_ps(a, uniform(xorshift(state)));
+}
+
+// load four samples, clip to unit range and scale
+inline __m128 loadScaled(const float* src, const __m128 scale)
+{
+    const __m128 in = _mm_load_ps(src);
+    const __m128 clip = _mm_min_ps(_mm_max_ps(in, _mm_set1_ps(-1.f)), _mm_set1_ps(1.f));
+    return _mm_mul_ps(clip, scale);
+}
+
+template <bool dithered>
+void convertS16Sse2(const float* src, void* dst, size_t count, DitherState* dither)
+{
+    int16_t* out = (int16_t*)dst;
+    const __m128 scale = _mm_set1_ps(32768.f);
+    __m128i state = _mm_setzero_si128();
+    if (dithered) {
+        state = _mm_loadu_si128((const __m128i*)dither->lanes);
+    }
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128 a = loadScaled(src + i + 0, scale);
+        __m128 b = loadScaled(src + i + 4, scale);
+        if (dithered) {
+            a = _mm_add_ps(a, tpdf(state));
+            b = _mm_add_ps(b, tpdf(state));
+        }
+        // packs saturates anything the dither pushed past full scale
+        const __m128i s16 = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128((__m128i*)(out + i), s16);
+    }
+    if (dithered) {
+        _mm_storeu_si128((__m128i*)dither->lanes, state);
+    }
+    convertScalar<FormatS16, dithered>(src + i, out + i, count - i, dither);
+}
+
+template <bool dithered>
+void convertU8Sse2(const float* src, void* dst, size_t count, DitherState* dither)
+{
+    uint8_t* out = (uint8_t*)dst;
+    const __m128 scale = _mm_set1_ps(128.f);
+    const __m128i bias = _mm_set1_epi16(128);
+    __m128i state = _mm_setzero_si128();
+    if (dithered) {
+        state = _mm_loadu_si128((const __m128i*)dither->lanes);
+    }
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i s16[2];
+        for (int j = 0; j < 2; ++j) {
+            __m128 a = loadScaled(src + i + j * 8 + 0, scale);
+            __m128 b = loadScaled(src + i + j * 8 + 4, scale);
+            if (dithered) {
+                a = _mm_add_ps(a, tpdf(state));
+                b = _mm_add_ps(b, tpdf(state));
+            }
+            const __m128i p = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+            s16[j] = _mm_add_epi16(p, bias);
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(s16[0], s16[1]));
+    }
+    if (dithered) {
+        _mm_storeu_si128((__m128i*)dither->lanes, state);
+    }
+    convertScalar<FormatU8, dithered>(src + i, out + i, count - i, dither);
+}
+
+inline void convertS32Sse2(const float* src, void* dst, size_t count, DitherState* dither)
+{
+    int32_t* out = (int32_t*)dst;
+    const __m128 scale = _mm_set1_ps(2147483648.f);
+    const __m128 limit = _mm_set1_ps(maxS32);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128 s = _mm_min_ps(loadScaled(src + i, scale), limit);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_cvtps_epi32(s));
+    }
+    convertScalar<FormatS32, false>(src + i, out + i, count - i, dither);
+}
+
+inline void convertF32Sse2(const float* src, void* dst, size_t count, DitherState* dither)
+{
+    float* out = (float*)dst;
+    const __m128 one = _mm_set1_ps(1.f);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, loadScaled(src + i, one));
+    }
+    convertScalar<FormatF32, false>(src + i, out + i, count - i, dither);
+}
+
+inline PW_TARGET_AVX2 __m256i xorshift(__m256i& state)
+{
+    state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+    state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+    state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+    return state;
+}
+
+inline PW_TARGET_AVX2 __m256 uniform(__m256i bits)
+{
+    const __m256i one = _mm256_set1_epi32(0x3f800000);
+    const __m256 out = _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(bits, 9), one));
+    return _mm256_sub_ps(out, _mm256_set1_ps(1.f));
+}
+
+inline PW_TARGET_AVX2 __m256 tpdf(__m256i& state)
+{
+    const __m256 a = uniform(xorshift(state));
+    return _mm256_sub_ps(a, uniform(xorshift(state)));
+}
+
+inline PW_TARGET_AVX2 __m256 loadScaled(const float* src, const __m256 scale)
+{
+    const __m256 in = _mm256_load_ps(src);
+    const __m256 clip =
+        _mm256_min_ps(_mm256_max_ps(in, _mm256_set1_ps(-1.f)), _mm256_set1_ps(1.f));
+    return _mm256_mul_ps(clip, scale);
+}
+
+template <bool dithered>
+PW_TARGET_AVX2 void convertS16Avx2(
+    const float* src, void* dst, size_t count, DitherState* dither)
+{
+    int16_t* out = (int16_t*)dst;
+    const __m256 scale = _mm256_set1_ps(32768.f);
+    __m256i state = _mm256_setzero_si256();
+    if (dithered) {
+        state = _mm256_loadu_si256((const __m256i*)dither->lanes);
+    }
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256 a = loadScaled(src + i + 0, scale);
+        __m256 b = loadScaled(src + i + 8, scale);
+        if (dithered) {
+            a = _mm256_add_ps(a, tpdf(state));
+            b = _mm256_add_ps(b, tpdf(state));
+        }
+        // packs works within 128 bit lanes so restore sample order after
+        const __m256i s16 =
+            _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(s16, 0xd8));
+    }
+    if (dithered) {
+        _mm256_storeu_si256((__m256i*)dither->lanes, state);
+    }
+    convertS16Sse2<dithered>(src + i, out + i, count - i, dither);
+}
+
+inline bool cpuHasAvx2()
+{
+#if defined(_MSC_VER)
+    int regs[4] = { 0 };
+    __cpuid(regs, 0);
+    if (regs[0] < 7) {
+        return false;
+    }
+    __cpuid(regs, 1);
+    // the os must save the ymm registers for us to use them
+    const int osxsave = 1 << 27, avx = 1 << 28;
+    if ((regs[2] & (osxsave | avx)) != (osxsave | avx)) {
+        return false;
+    }
+    if ((_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif // PW_X86
+
+// pick the fastest conversion kernel for a device sample format, only the
+// 8, 16 and 24 bit formats are dithered
+inline ConvertProc selectConvert(uint32_t bitDepth, uint32_t sampleFormat, bool dithered)
+{
+    if (sampleFormat == PW_SAMPLE_FLOAT) {
+#if defined(PW_X86)
+        return convertF32Sse2;
+#else
+        return convertScalar<FormatF32, false>;
+#endif
+    }
+    switch (bitDepth) {
+#if defined(PW_X86)
+    // sse2 is baseline for every x64 cpu
+    case 8:
+        return dithered ? convertU8Sse2<true> : convertU8Sse2<false>;
+    case 24:
+        return dithered ? convertScalar<FormatS24, true> : convertScalar<FormatS24, false>;
+    case 32:
+        return convertS32Sse2;
+    default:
+        if (cpuHasAvx2()) {
+            return dithered ? convertS16Avx2<true> : convertS16Avx2<false>;
+        }
+        return dithered ? convertS16Sse2<true> : convertS16Sse2<false>;
+#else
+    case 8:
+        return dithered ? convertScalar<FormatU8, true> : convertScalar<FormatU8, false>;
+    case 24:
+        return dithered ? convertScalar<FormatS24, true> : convertScalar<FormatS24, false>;
+    case 32:
+        return convertScalar<FormatS32, false>;
+    default:
+        return dithered ? convertScalar<FormatS16, true> : convertScalar<FormatS16, false>;
+#endif
+    }
+}
+
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Mixing
+
+// accumulate count float samples from src into dst scaled by gain
+typedef void (*MixAddProc)(float* dst, const float* src, size_t count, float gain);
+
+inline void mixAddScalar(float* dst, const float* src, size_t count, float gain)
+{
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] += src[i] * gain;
+    }
+}
+
+#if defined(PW_X86)
+inline void mixAddSse2(float* dst, const float* src, size_t count, float gain)
+{
+    const __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128 a = _mm_add_ps(_mm_loadu_ps(dst + i + 0), _mm_mul_ps(_mm_loadu_ps(src + i + 0), g));
+        const __m128 b = _mm_add_ps(_mm_loadu_ps(dst + i + 4), _mm_mul_ps(_mm_loadu_ps(src + i + 4), g));
+        _mm_storeu_ps(dst + i + 0, a);
+        _mm_storeu_ps(dst + i + 4, b);
+    }
+    mixAddScalar(dst + i, src + i, count - i, gain);
+}
+
+inline PW_TARGET_AVX2 void mixAddAvx2(float* dst, const float* src, size_t count, float gain)
+{
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m256 a = _mm256_add_ps(
+            _mm256_loadu_ps(dst + i + 0), _mm256_mul_ps(_mm256_loadu_ps(src + i + 0), g));
+        const __m256 b = _mm256_add_ps(
+            _mm256_loadu_ps(dst + i + 8), _mm256_mul_ps(_mm256_loadu_ps(src + i + 8), g));
+        _mm256_storeu_ps(dst + i + 0, a);
+        _mm256_storeu_ps(dst + i + 8, b);
+    }
+    mixAddSse2(dst + i, src + i, count - i, gain);
+}
+#endif // PW_X86
+
+inline MixAddProc selectMixAdd()
+{
+#if defined(PW_X86)
+    return cpuHasAvx2() ? mixAddAvx2 : mixAddSse2;
+#else
+    return mixAddScalar;
+#endif
+}
+
+// scale numFrames interleaved frames by a gain that steps once per frame
+// before each is applied, returns the gain of the last frame
+typedef float (*RampProc)(
+    float* buffer, size_t numFrames, uint32_t channels, float gain, float step);
+
+// split interleaved frames into one run per channel, stride floats apart
+typedef void (*DeinterleaveProc)(
+    const float* in, size_t numFrames, uint32_t channels, float* out, size_t stride);
+
+// the per frame kernels are instanced for the common channel counts so the
+// inner loop unrolls, 0 takes the count at runtime for the rest
+template <uint32_t fixed>
+float rampGain(float* buffer, size_t numFrames, uint32_t channels, float gain, float step)
+{
+    const uint32_t count = fixed ? fixed : channels;
+    for (size_t i = 0; i < numFrames; ++i) {
+        gain += step;
+        for (uint32_t c = 0; c < count; ++c) {
+            buffer[i * count + c] *= gain;
+        }
+    }
+    return gain;
+}
+
+template <uint32_t fixed>
+void deinterleave(const float* in, size_t numFrames, uint32_t channels, float* out, size_t stride)
+{
+    const uint32_t count = fixed ? fixed : channels;
+    for (size_t i = 0; i < numFrames; ++i) {
+        for (uint32_t c = 0; c < count; ++c) {
+            out[c * stride + i] = in[i * count + c];
+        }
+    }
+}
+
+// a constant gain does not care where frames start
+inline void scaleSamples(float* buffer, size_t count, float gain)
+{
+    for (size_t i = 0; i < count; ++i) {
+        buffer[i] *= gain;
+    }
+}
+
+inline RampProc selectRamp(uint32_t channels)
+{
+    switch (channels) {
+    case 1:
+        return rampGain<1>;
+    case 2:
+        return rampGain<2>;
+    case 4:
+        return rampGain<4>;
+    case 6:
+        return rampGain<6>;
+    case 8:
+        return rampGain<8>;
+    default:
+        return rampGain<0>;
+    }
+}
+
+inline DeinterleaveProc selectDeinterleave(uint32_t channels)
+{
+    switch (channels) {
+    case 1:
+        return deinterleave<1>;
+    case 2:
+        return deinterleave<2>;
+    case 4:
+        return deinterleave<4>;
+    case 6:
+        return deinterleave<6>;
+    case 8:
+        return deinterleave<8>;
+    default:
+        return deinterleave<0>;
+    }
+}
+// ---- ---- ---- ---- ---- ---- ---- ---- ---- ---- Controls
+
+// the callback and output gain, changed by other threads through the command
+// queue and applied by the service thread ahead of each period
+struct Controls {
+
+    Controls()
+    {
+        reset(NULL, NULL);
+    }
+
+    // only while the service thread is not rendering
+    void reset(WaveProc proc, void* data)
+    {
+        commands.reset();
+        callback = proc;
+        callbackData = data;
+        gain = gainTarget = 1.f;
+        gainStep = 0.f;
+        gainFrames = 0;
+    }
+
+    // apply every queued command, swaps counts the callbacks replaced
+    void drain(atomic64_t& swaps)
+    {
+        Command cmd;
+        while (commands.take(cmd)) {
+            switch (cmd.type) {
+            case CMD_GAIN:
+                gainTarget = cmd.gain;
+                gainFrames = cmd.rampFrames;
+                if (gainFrames == 0) {
+                    gain = gainTarget;
+                } else {
+                    gainStep = (gainTarget - gain) / float(gainFrames);
+                }
+                break;
+            case CMD_CALLBACK:
+                callback = cmd.callback;
+                callbackData = cmd.callbackData;
+                // published after the swap, the old callback is done with now
+                atomicAdd64(swaps, 1);
+                break;
+            }
+        }
+    }
+
+    // false when the gain would leave the samples untouched
+    bool hasGain() const
+    {
+        return gain != 1.f || gainFrames;
+    }
+
+    void applyGain(RampProc ramp, float* buffer, size_t numFrames, uint32_t channels)
+    {
+        // the ramp steps once per frame and its last frame lands exactly on
+        // the target
+        size_t ramped = 0;
+        if (gainFrames) {
+            ramped = gainFrames <= numFrames ? gainFrames - 1 : numFrames;
+            gain = ramp(buffer, ramped, channels, gain, gainStep);
+            gainFrames -= uint32_t(ramped);
+            if (ramped < numFrames) {
+                gain = gainTarget;
+                gainFrames = 0;
+            }
+        }
+        scaleSamples(buffer + ramped * channels, (numFrames - ramped) * channels, gain);
+    }
+
+    CommandQueue commands;
+    WaveProc callback;
+    void* callbackData;
+    // output gain and the ramp toward gainTarget still to run
+    float gain;
+    float gainStep;
+    float gainTarget;
+    uint32_t gainFrames;
+};
+
+}